@@ -0,0 +1,563 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* One producer, and several consumers which each read every message,
+   after the LMAX Disruptor.  Unlike mempipe there are no per-message
+   headers to say whether a message is there: the ring is a power of
+   two of td->size slots, message n goes in slot n % nr_slots, and
+   everyone says how far they've got with a cursor of their own, each
+   on its own cache line in the control pages in front of the ring.
+   The producer's is how many messages it's published; a consumer's
+   is how many it's finished with.
+
+   A consumer can say that it depends on other consumers, and then it
+   only reads what all of them have finished with as well as what the
+   producer's published, which is how a pipeline gets its journaling
+   done before its processing.  DISRUPTOR_STAGES splits the consumers
+   into that many stages, each depending on every consumer in the one
+   before, and the producer only has to wait for the consumers which
+   nobody depends on, since the rest are ahead of them.  Anyone who
+   finds nothing new past their barrier reads all of what's there
+   before they look again, and only moves their own cursor on once
+   they're done with that batch, or a quarter of the ring, so that
+   the cursor lines don't bounce about more than they have to.
+
+   Messages can be any size up to td->size, for -d; each slot's size
+   goes in an array of its own after the ring, so that the payloads
+   keep their alignment and sixteen messages share a line of sizes.
+
+   The harness's child is consumer 0, in the last stage, and sees
+   every message in order, so the headline is what one consumer gets
+   and -v and -V work as usual.  DISRUPTOR_CONSUMERS - 1 more run
+   alongside it, in processes or threads to match -T, on the cores
+   after it, and check each message as the child would, or copy it
+   out.  Waiting is with -W, on the cursor we're waiting for; the
+   strategies which sleep do so on an event count next to it, which
+   whoever moves the cursor only bumps if someone's asleep on it.
+   The disruptor log has the fan-out, every consumer's throughput
+   added up, and how often everyone had to wait. */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "test.h"
+#include "xutil.h"
+#include "futex.h"
+#include "kernels.h"
+#include "verify.h"
+
+#define CACHE_LINE_SIZE 64
+#define MAX_CONSUMERS 16
+
+static int ring_order = 9;
+static int nr_consumers = 1;
+static int nr_stages = 1;
+
+static tunable tunables[] = {
+  { "DISRUPTOR_RING_ORDER", &ring_order, 0, 15 },
+  { "DISRUPTOR_CONSUMERS", &nr_consumers, 1, MAX_CONSUMERS, 1 },
+  { "DISRUPTOR_STAGES", &nr_stages, 1, MAX_CONSUMERS },
+  { NULL }
+};
+
+struct cursor {
+  volatile unsigned long seq;
+  volatile unsigned ev; /* Event count, for sleeping on */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct party_stats {
+  unsigned long waits; /* Found nothing past the barrier */
+  unsigned long batches; /* Times we looked and found something */
+  unsigned long messages;
+  unsigned long bytes; /* The producer's */
+  unsigned long stop_tsc;
+  volatile int done;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct disruptor_control {
+  struct cursor producer;
+  struct cursor consumers[MAX_CONSUMERS];
+  /* Who each consumer waits for, as a mask of consumers, or 0 for
+     just the producer, and who the producer waits for */
+  unsigned deps[MAX_CONSUMERS];
+  unsigned gating;
+  int stage[MAX_CONSUMERS];
+  unsigned long start_tsc;
+  struct party_stats producer_stats;
+  struct party_stats stats[MAX_CONSUMERS];
+};
+
+#define CTRL_PAGES ((sizeof(struct disruptor_control) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct disruptor_state {
+  struct disruptor_control *ctrl;
+  char *ring;
+  unsigned *sizes; /* Of the message in each slot */
+  unsigned long nr_slots;
+  size_t stride;
+  int kind, budget; /* How to wait, from -W */
+  pid_t helper_pids[MAX_CONSUMERS];
+  pthread_t helper_threads[MAX_CONSUMERS];
+};
+
+/* The producer's or a consumer's own */
+static __thread struct {
+  struct spin_estimate est;
+  struct cursor *cursor;
+  struct party_stats *st;
+  unsigned deps;
+  unsigned long next; /* The next message we'll write or read */
+  unsigned long avail; /* What the barrier said last time we looked */
+  unsigned long published; /* What we last told everyone */
+  char *scratch;
+  test_data *watch; /* The harness's parent watches consumer 0 */
+} me;
+
+static char *
+slot(struct disruptor_state *ds, unsigned long seq)
+{
+  return ds->ring + (seq & (ds->nr_slots - 1)) * ds->stride;
+}
+
+static volatile unsigned *
+slot_size(struct disruptor_state *ds, unsigned long seq)
+{
+  return &ds->sizes[seq & (ds->nr_slots - 1)];
+}
+
+/* Make consumer c wait for consumer on as well as whatever it waited
+   for before */
+static void
+depend_on(struct disruptor_control *ctrl, int c, int on)
+{
+  ctrl->deps[c] |= 1u << on;
+  ctrl->gating &= ~(1u << on);
+}
+
+/* The least of the cursors in deps, or the producer's if there are
+   none, and which one that was */
+static unsigned long
+barrier(struct disruptor_state *ds, unsigned deps, struct cursor **lag)
+{
+  unsigned long min = ~0ul, seq;
+  int i;
+
+  *lag = &ds->ctrl->producer;
+  if (!deps)
+    return (*lag)->seq;
+  for (i = 0; i < nr_consumers; i++) {
+    if (!(deps & (1u << i)))
+      continue;
+    seq = ds->ctrl->consumers[i].seq;
+    if (seq < min) {
+      min = seq;
+      *lag = &ds->ctrl->consumers[i];
+    }
+  }
+  return min;
+}
+
+/* Consumer 0 is the harness's child, which exits without saying so
+   if it fails a check, and then the producer can wait on its cursor
+   for ever */
+static void
+check_consumer(void *arg)
+{
+  test_data *td = arg;
+  struct disruptor_state *ds = td->data;
+  int i;
+
+  if (ds->ctrl->stats[0].done || !child_exited(td) || ds->ctrl->stats[0].done)
+    return;
+  for (i = 1; i < nr_consumers; i++)
+    kill(ds->helper_pids[i], SIGKILL);
+  errx(1, "consumer 0 failed");
+}
+
+/* Wait until the cursors in deps have all got past want, and return
+   where the slowest of them is */
+static unsigned long
+wait_past(struct disruptor_state *ds, unsigned deps, unsigned long want)
+{
+  struct cursor *lag;
+  struct waiter w;
+  unsigned long seq;
+  unsigned cur;
+
+  seq = barrier(ds, deps, &lag);
+  if (seq > want)
+    return seq;
+  me.st->waits++;
+  waiter_start(&w, ds->kind, ds->budget, &me.est);
+  if (me.watch)
+    waiter_check(&w, check_consumer, me.watch);
+  while (seq <= want) {
+    if (wait_round(&w, (volatile unsigned *)&lag->seq, (unsigned)seq)) {
+      /* Say we're asleep, then look again, in case it moved before
+	 we'd said so */
+      cur = lag->ev;
+      if ((cur & WAIT_SLEEPING) ||
+	  atomic_cmpxchg(&lag->ev, cur, cur | WAIT_SLEEPING) == cur) {
+	if (lag->seq == seq)
+	  waiter_sleep(&w, &lag->ev, cur | WAIT_SLEEPING);
+      }
+    }
+    seq = barrier(ds, deps, &lag);
+  }
+  waiter_done(&w);
+  return seq;
+}
+
+/* Move our cursor on, and wake anyone asleep waiting for it.  The
+   barrier's so that our check for sleepers can't be answered before
+   the new cursor's visible. */
+static void
+advance(struct disruptor_state *ds, unsigned long seq)
+{
+  struct cursor *c = me.cursor;
+
+  asm volatile ("" : : : "memory");
+  c->seq = seq;
+  me.published = seq;
+  if (!wait_sleeps(ds->kind))
+    return;
+  memory_barrier();
+  if (c->ev & WAIT_SLEEPING)
+    wake_all_with(ds->kind, &c->ev, ((c->ev & ~WAIT_SLEEPING) + 1) & ~WAIT_SLEEPING);
+}
+
+static void
+start_party(struct cursor *cursor, struct party_stats *st, unsigned deps)
+{
+  me.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  me.cursor = cursor;
+  me.st = st;
+  me.deps = deps;
+  me.next = me.avail = me.published = 0;
+}
+
+/* The next message, for a consumer */
+static char *
+next_message(struct disruptor_state *ds)
+{
+  if (me.next >= me.avail) {
+    /* Done with the last batch, so let whoever's behind us have it */
+    if (me.published != me.next)
+      advance(ds, me.next);
+    me.avail = wait_past(ds, me.deps, me.next);
+    me.st->batches++;
+  }
+  return slot(ds, me.next);
+}
+
+static void
+done_with_message(struct disruptor_state *ds)
+{
+  me.next++;
+  me.st->messages++;
+  if (me.next - me.published >= ds->nr_slots / 4)
+    advance(ds, me.next);
+}
+
+static void
+check_or_copy(test_data *td, char *p, unsigned long seq)
+{
+  unsigned size = *slot_size(td->data, seq);
+  struct iovec vec = { .iov_base = p, .iov_len = size };
+  struct msg_stamp st;
+  int bad = 0;
+
+  if (td->do_verify == VERIFY_STAMP)
+    bad = check_message(&vec, 1, seq, &st) != STAMP_OK;
+  else if (td->do_verify)
+    bad = td->kernel->check(p, (char)seq, size);
+  else
+    td->kernel->copy(me.scratch, p, size);
+  if (bad)
+    errx(1, "consumer found message %lu bad", seq);
+}
+
+static void
+finish_party(struct disruptor_state *ds)
+{
+  if (me.published != me.next)
+    advance(ds, me.next);
+  me.st->stop_tsc = rdtsc();
+  me.st->done = 1;
+}
+
+static void
+helper_main(test_data *td, int id)
+{
+  struct disruptor_state *ds = td->data;
+
+  setaffinity((td->first_core + id) % sysconf(_SC_NPROCESSORS_ONLN));
+  start_party(&ds->ctrl->consumers[id], &ds->ctrl->stats[id],
+	      ds->ctrl->deps[id]);
+  me.scratch = xmalloc(td->size);
+  while (me.next < td->count) {
+    check_or_copy(td, next_message(ds), me.next);
+    done_with_message(ds);
+  }
+  free(me.scratch);
+  finish_party(ds);
+}
+
+struct helper_args {
+  test_data *td;
+  int id;
+};
+
+static void *
+helper_thread(void *_args)
+{
+  struct helper_args *args = _args;
+
+  helper_main(args->td, args->id);
+  free(args);
+  return NULL;
+}
+
+static void
+start_helper(test_data *td, int id)
+{
+  struct disruptor_state *ds = td->data;
+  struct helper_args *args;
+  pid_t pid;
+  int r;
+
+  if (!td->threaded) {
+    pid = fork();
+    if (pid < 0)
+      err(1, "fork()");
+    if (!pid) {
+      helper_main(td, id);
+      _exit(0);
+    }
+    ds->helper_pids[id] = pid;
+    return;
+  }
+  args = xmalloc(sizeof(*args));
+  args->td = td;
+  args->id = id;
+  r = pthread_create(&ds->helper_threads[id], NULL, helper_thread, args);
+  if (r != 0)
+    errx(1, "pthread_create: %s", strerror(r));
+}
+
+static void
+stop_helper(test_data *td, int id)
+{
+  struct disruptor_state *ds = td->data;
+  int status, r;
+
+  if (td->threaded) {
+    r = pthread_join(ds->helper_threads[id], NULL);
+    if (r != 0)
+      errx(1, "pthread_join: %s", strerror(r));
+    return;
+  }
+  if (waitpid(ds->helper_pids[id], &status, 0) < 0)
+    err(1, "waitpid()");
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    errx(1, "consumer %d failed", id);
+}
+
+static void
+init_test(test_data *td)
+{
+  struct disruptor_state *ds = xmalloc(sizeof(*ds));
+  size_t ring_bytes = (size_t)PAGE_SIZE << ring_order;
+  struct disruptor_control *ctrl;
+  int i, j, stages, size_pages;
+
+  memset(ds, 0, sizeof(*ds));
+  ds->stride = (td->size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  ds->nr_slots = ring_bytes / ds->stride;
+  if (ds->nr_slots < 2)
+    errx(1, "%d byte messages need a bigger DISRUPTOR_RING_ORDER", td->size);
+  ds->nr_slots = 1ul << (63 - __builtin_clzl(ds->nr_slots));
+  size_pages = (ds->nr_slots * sizeof(ds->sizes[0]) + PAGE_SIZE - 1) / PAGE_SIZE;
+  ds->ctrl = ctrl = establish_test_segment(td, CTRL_PAGES + (1 << ring_order) + size_pages);
+  ds->ring = (char *)ctrl + CTRL_PAGES * PAGE_SIZE;
+  ds->sizes = (unsigned *)(ds->ring + ring_bytes);
+  memset(ctrl, 0, sizeof(*ctrl));
+
+  /* Consumer 0 goes in the last stage, and the rest are dealt out
+     backwards from there */
+  stages = nr_stages < nr_consumers ? nr_stages : nr_consumers;
+  ctrl->gating = (1u << nr_consumers) - 1;
+  for (i = 0; i < nr_consumers; i++)
+    ctrl->stage[i] = stages - 1 - i % stages;
+  for (i = 0; i < nr_consumers; i++)
+    for (j = 0; j < nr_consumers; j++)
+      if (ctrl->stage[j] == ctrl->stage[i] - 1)
+	depend_on(ctrl, i, j);
+
+  ds->kind = td->wait_strategy < 0 ? WAIT_FUTEX : td->wait_strategy;
+  ds->budget = td->spin_budget;
+  td->data = ds;
+  get_tsc_freq();
+}
+
+static void
+init_parent(test_data *td)
+{
+  struct disruptor_state *ds = td->data;
+  int i;
+
+  start_party(&ds->ctrl->producer, &ds->ctrl->producer_stats, ds->ctrl->gating);
+  for (i = 1; i < nr_consumers; i++)
+    start_helper(td, i);
+  if (!td->threaded)
+    me.watch = td;
+}
+
+static struct iovec *
+get_write_buffer(test_data *td, int size, int *n_vecs)
+{
+  struct disruptor_state *ds = td->data;
+  static __thread struct iovec vec;
+
+  if (!ds->ctrl->start_tsc)
+    ds->ctrl->start_tsc = rdtsc();
+  /* Wait for the slowest of the last stage to be done with this
+     slot's previous message */
+  if (me.next >= me.avail + ds->nr_slots)
+    me.avail = wait_past(ds, me.deps, me.next - ds->nr_slots);
+  vec.iov_base = slot(ds, me.next);
+  vec.iov_len = size;
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_write_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  *slot_size(td->data, me.next) = vecs[0].iov_len;
+  me.next++;
+  me.st->messages++;
+  me.st->bytes += vecs[0].iov_len;
+  advance(td->data, me.next);
+}
+
+static void
+finish_parent(test_data *td)
+{
+  struct disruptor_state *ds = td->data;
+  struct disruptor_control *ctrl = ds->ctrl;
+  double freq = get_tsc_freq();
+  unsigned long stop = 0;
+  char per[MAX_CONSUMERS * 80], *p = per;
+  double secs, mbps;
+  int i;
+
+  for (i = 1; i < nr_consumers; i++)
+    stop_helper(td, i);
+  while (!ctrl->stats[0].done) {
+    check_consumer(td);
+    sched_yield();
+  }
+
+  per[0] = 0;
+  for (i = 0; i < nr_consumers; i++) {
+    struct party_stats *st = &ctrl->stats[i];
+    if (st->stop_tsc > stop)
+      stop = st->stop_tsc;
+    p += snprintf(p, per + sizeof(per) - p, " c%d:%d waits %lu batch %.1f", i, ctrl->stage[i], st->waits,
+		 st->batches ? (double)st->messages / st->batches : 0);
+  }
+  secs = (stop - ctrl->start_tsc) / freq;
+  mbps = secs > 0 ? ctrl->producer_stats.bytes * 8 / (secs * 1e6) : 0;
+  logmsg(td, "disruptor",
+	 "%s %d consumers %d stages %d slots %lu %.0f Mbps each %.0f Mbps "
+	 "fan-out producer waits %lu%s %s\n",
+	 td->name, td->size, nr_consumers, ctrl->stage[0] + 1, ds->nr_slots,
+	 mbps, mbps * nr_consumers, ctrl->producer_stats.waits, per,
+	 wait_strategy_names[ds->kind]);
+}
+
+static void
+init_child(test_data *td)
+{
+  struct disruptor_state *ds = td->data;
+
+  start_party(&ds->ctrl->consumers[0], &ds->ctrl->stats[0], ds->ctrl->deps[0]);
+}
+
+static struct iovec *
+get_read_buffer(test_data *td, int size, int *n_vecs)
+{
+  static __thread struct iovec vec;
+
+  vec.iov_base = next_message(td->data);
+  vec.iov_len = *slot_size(td->data, me.next);
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_read_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  done_with_message(td->data);
+}
+
+static void
+finish_child(test_data *td)
+{
+  finish_party(td->data);
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_t t = {
+    .name = "disruptor_thr",
+    .is_latency_test = 0,
+    .variable_size = 1,
+    .tunables = tunables,
+    .wait_strategies = WAIT_ALL,
+    .init_test = init_test,
+    .init_parent = init_parent,
+    .finish_parent = finish_parent,
+    .init_child = init_child,
+    .finish_child = finish_child,
+    .get_write_buffer = get_write_buffer,
+    .release_write_buffer = release_write_buffer,
+    .get_read_buffer = get_read_buffer,
+    .release_read_buffer = release_read_buffer
+  };
+  run_test(argc, argv, &t);
+  return 0;
+}
@@ -1,8 +1,41 @@
 #ifndef FUTEX_H__
 #define FUTEX_H__
 
+#include <sys/syscall.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef Linux
+#include <linux/futex.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 static inline unsigned
 atomic_cmpxchg(volatile unsigned *loc, unsigned old, unsigned new)
+{
+  unsigned res;
+  asm ("lock cmpxchg %3, %1\n"
+       : "=a" (res), "=m" (*loc)
+       : "0" (old),
+	 "r" (new),
+	 "m" (*loc)
+       : "memory");
+  return res;
+}
+
+static inline unsigned long
+atomic_cmpxchg_long(volatile unsigned long *loc, unsigned long old,
+		    unsigned long new)
 {
   unsigned long res;
   asm ("lock cmpxchg %3, %1\n"
@@ -16,6 +49,19 @@ atomic_cmpxchg(volatile unsigned *loc, unsigned old, unsigned new)
 
 static inline unsigned
 atomic_xchg(volatile unsigned *loc, unsigned new)
+{
+  unsigned res;
+  asm ("xchg %0, %1\n"
+       : "=r" (res),
+	 "=m" (*loc)
+       : "m" (*loc),
+	 "0" (new)
+       : "memory");
+  return res;
+}
+
+static inline unsigned long
+atomic_xchg_long(volatile unsigned long *loc, unsigned long new)
 {
   unsigned long res;
   asm ("xchg %0, %1\n"
@@ -27,6 +73,36 @@ atomic_xchg(volatile unsigned *loc, unsigned new)
   return res;
 }
 
+static inline void
+atomic_or_long(volatile unsigned long *loc, unsigned long bits)
+{
+  asm ("lock or %1, %0\n"
+       : "+m" (*loc)
+       : "r" (bits)
+       : "memory");
+}
+
+/* Add to *loc and return what it was before */
+static inline unsigned long
+atomic_fetch_add_long(volatile unsigned long *loc, unsigned long n)
+{
+  asm ("lock xadd %0, %1\n"
+       : "+r" (n),
+	 "+m" (*loc)
+       :
+       : "memory");
+  return n;
+}
+
+/* Full barrier: nothing after it, loads included, happens until
+   everything before it is visible everywhere */
+static inline void
+memory_barrier(void)
+{
+  asm volatile ("mfence\n" : : : "memory");
+}
+
+#ifdef Linux
 static inline int
 futex(volatile unsigned *slot, int cmd, unsigned val, const struct timespec *ts,
       int *uaddr, int val2)
@@ -42,6 +118,18 @@ futex_wait_while_equal(volatile unsigned *slot, unsigned val)
     err(1, "futex_wait");
 }
 
+/* The same, but giving up after ns nanoseconds */
+static inline void
+futex_wait_while_equal_for(volatile unsigned *slot, unsigned val, long ns)
+{
+  struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+  assert((unsigned long)slot % 4 == 0);
+  if (futex(slot, FUTEX_WAIT, val, &ts, NULL, 0) < 0 && errno != EAGAIN &&
+      errno != ETIMEDOUT && errno != EINTR)
+    err(1, "futex_wait");
+}
+
 static inline void
 futex_wake(volatile unsigned *slot)
 {
@@ -49,4 +137,361 @@ futex_wake(volatile unsigned *slot)
     err(1, "futex_wake");
 }
 
+static inline void
+futex_wake_all(volatile unsigned *slot)
+{
+  if (futex(slot, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0)
+    err(1, "futex_wake");
+}
+
+#ifdef SYS_futex_waitv
+#define HAVE_FUTEX_WAITV 1
+/* Sleep until one of the nr words isn't what its entry says it
+   should be, and return the index of the one which woke us, or -1
+   with errno EAGAIN if one was different already.  Kernels before 5.16
+   say ENOSYS. */
+static inline int
+futex_waitv(struct futex_waitv *waiters, unsigned nr)
+{
+  return syscall(SYS_futex_waitv, waiters, nr, 0, NULL, CLOCK_MONOTONIC);
+}
+#endif
+
+#else
+/* Nothing picks WAIT_FUTEX where there aren't any */
+static inline void
+futex_wait_while_equal(volatile unsigned *slot, unsigned val)
+{
+  abort();
+}
+
+static inline void
+futex_wait_while_equal_for(volatile unsigned *slot, unsigned val, long ns)
+{
+  abort();
+}
+
+static inline void
+futex_wake(volatile unsigned *slot)
+{
+  abort();
+}
+
+static inline void
+futex_wake_all(volatile unsigned *slot)
+{
+  abort();
+}
+#endif
+
+/* Ways of waiting for a word of shared memory to change, for -W.  The
+   ones which sleep in the kernel need the other end to wake them,
+   and so need a protocol for saying that they're asleep; the rest
+   just trade how quickly they notice against how much CPU they burn
+   doing so. */
+#define WAIT_SPIN 0 /* Keep reading it */
+#define WAIT_PAUSE 1 /* ...with pauses in between, backing off exponentially */
+#define WAIT_YIELD 2 /* ...with sched_yield() in between */
+#define WAIT_FUTEX 3 /* Spin for a budget of pauses, then futex_wait() */
+#define WAIT_UMWAIT 4 /* umonitor/umwait, if the CPU has WAITPKG */
+#define WAIT_ADAPTIVE 5 /* Like futex, but learns how long to spin */
+#define NR_WAIT_STRATEGIES 6
+
+#define WAIT_ALL ((1 << NR_WAIT_STRATEGIES) - 1)
+
+#define PAUSE_BACKOFF_MAX 1024 /* pauses, about 10-140us depending on the CPU */
+#define UMWAIT_TICKS 100000 /* How long one umwait can last, in TSC ticks */
+/* How often a waiter with a check (waiter_check()) makes it, and how
+   long it sleeps for at a time in between */
+#define WAIT_CHECK_TICKS 20000000 /* About 5-10ms */
+#define WAIT_CHECK_NS 10000000
+/* WAIT_ADAPTIVE spins for twice as long as waits have lately been
+   taking, and not at all once they typically take longer than this,
+   about 50-100us: by then a futex wake is cheap by comparison. */
+#define ADAPTIVE_SPIN_MAX 200000 /* TSC ticks */
+#define ADAPTIVE_SHIFT 3 /* Each wait moves the estimates 1/8 of the way */
+/* It also gives up spinning when that's stopped working, which it
+   never does when the other end needs our CPU to get anything done,
+   but has another go now and again in case things have changed. */
+#define ADAPTIVE_MIN_HITS 64 /* Out of 256 spins */
+#define ADAPTIVE_PROBE 16 /* Waits between goes */
+
+static const char *const wait_strategy_names[NR_WAIT_STRATEGIES] = {
+  "spin", "pause", "yield", "futex", "umwait", "adaptive"
+};
+
+/* Whether the other end has to wake us */
+static inline int
+wait_sleeps(int kind)
+{
+  return kind == WAIT_FUTEX || kind == WAIT_ADAPTIVE;
+}
+
+static inline int
+have_waitpkg(void)
+{
+#if defined(__x86_64__)
+  unsigned a, b, c, d;
+
+  if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+    return !!(c & (1 << 5));
+#endif
+  return 0;
+}
+
+static inline int
+wait_strategy_supported(int kind)
+{
+  switch (kind) {
+  case WAIT_FUTEX:
+  case WAIT_ADAPTIVE:
+#ifdef Linux
+    return 1;
+#else
+    return 0;
+#endif
+  case WAIT_UMWAIT:
+    return have_waitpkg();
+  }
+  return 1;
+}
+
+/* <strategy>[:<spin budget>], the budget being for futex only.
+   Non-zero if it isn't one. */
+static inline int
+parse_wait_strategy(const char *spec, int *kind, int *budget)
+{
+  char name[16];
+  int i, n;
+
+  *budget = 0;
+  n = sscanf(spec, "%15[a-z]:%d", name, budget);
+  if (n < 1 || *budget < 0)
+    return -1;
+  for (i = 0; i < NR_WAIT_STRATEGIES; i++)
+    if (!strcmp(name, wait_strategy_names[i]))
+      break;
+  if (i == NR_WAIT_STRATEGIES || (n == 2 && i != WAIT_FUTEX))
+    return -1;
+  *kind = i;
+  return 0;
+}
+
+static inline void
+cpu_relax(void)
+{
+  asm volatile ("pause\n" : : : "memory");
+}
+
+/* TSC ticks, or nanoseconds where there isn't one */
+static inline unsigned long
+wait_clock(void)
+{
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+#endif
+}
+
+#if defined(__x86_64__)
+static inline __attribute__((target("waitpkg"))) void
+umwait_while_equal(volatile unsigned *slot, unsigned val)
+{
+  _umonitor((void *)slot);
+  if (*slot == val)
+    _umwait(0, __rdtsc() + UMWAIT_TICKS); /* 0 for the deeper C0.2 */
+}
+#else
+static inline void
+umwait_while_equal(volatile unsigned *slot, unsigned val)
+{
+  abort();
+}
+#endif
+
+/* What WAIT_ADAPTIVE has learnt about this end's waits, from one to
+   the next.  A wait which ends up asleep counts from when it went to
+   sleep until it's woken, so that the time we spent spinning, which
+   might have been what held the other end up, doesn't count; what's
+   left includes the cost of the wake, but that's what spinning would
+   have had to beat. */
+struct spin_estimate {
+  unsigned long typical; /* Moving average, in wait_clock() ticks */
+  unsigned hits; /* How often spinning for it worked, out of 256 */
+  unsigned waits;
+};
+
+#define SPIN_ESTIMATE_INIT { 0, 256, 0 }
+
+/* One wait, from when we first find the word unchanged until it
+   changes */
+struct waiter {
+  int kind;
+  int budget;
+  int spins; /* Pauses so far */
+  struct spin_estimate *est; /* WAIT_ADAPTIVE only */
+  unsigned long start, limit;
+  unsigned long slept; /* When we gave up spinning, or 0 */
+  /* Called now and again while we wait, in case whoever should
+     change the word has gone */
+  void (*check)(void *);
+  void *check_arg;
+  unsigned long checked;
+};
+
+static inline void
+waiter_start(struct waiter *w, int kind, int budget, struct spin_estimate *est)
+{
+  w->kind = kind;
+  w->budget = budget;
+  w->spins = 0;
+  w->est = est;
+  w->start = w->limit = w->slept = 0;
+  w->check = NULL;
+  w->checked = 0;
+  if (kind == WAIT_ADAPTIVE) {
+    w->start = wait_clock();
+    if (est->typical < ADAPTIVE_SPIN_MAX &&
+	(est->hits >= ADAPTIVE_MIN_HITS || ++est->waits % ADAPTIVE_PROBE == 0))
+      w->limit = est->typical * 2;
+  }
+}
+
+/* Call check(arg) every WAIT_CHECK_TICKS or so while we wait, and
+   never sleep for longer than WAIT_CHECK_NS without doing so */
+static inline void
+waiter_check(struct waiter *w, void (*check)(void *), void *arg)
+{
+  w->check = check;
+  w->check_arg = arg;
+  w->checked = wait_clock();
+}
+
+/* For the strategies which sleep, once wait_round() says so and
+   we've said that we're asleep in slot */
+static inline void
+waiter_sleep(struct waiter *w, volatile unsigned *slot, unsigned val)
+{
+  if (w->check)
+    futex_wait_while_equal_for(slot, val, WAIT_CHECK_NS);
+  else
+    futex_wait_while_equal(slot, val);
+}
+
+/* The word's changed: learn from how long that took */
+static inline void
+waiter_done(struct waiter *w)
+{
+  unsigned long took;
+
+  if (w->kind != WAIT_ADAPTIVE)
+    return;
+  took = wait_clock() - (w->slept ? w->slept : w->start);
+  if (w->limit)
+    w->est->hits += ((w->slept ? 0 : 256) >> ADAPTIVE_SHIFT) -
+      (w->est->hits >> ADAPTIVE_SHIFT);
+  /* Capped, so that one long idle spell doesn't take ages to forget */
+  if (took > 2 * ADAPTIVE_SPIN_MAX)
+    took = 2 * ADAPTIVE_SPIN_MAX;
+  w->est->typical += (took >> ADAPTIVE_SHIFT) -
+    (w->est->typical >> ADAPTIVE_SHIFT);
+}
+
+/* Wait a little while for *slot to stop being val.  Returns non-zero
+   when the caller should go to sleep on it instead, which only
+   WAIT_FUTEX and WAIT_ADAPTIVE do, and then every time once their
+   budget's gone. */
+static inline int
+wait_round(struct waiter *w, volatile unsigned *slot, unsigned val)
+{
+  int i, n;
+
+  if (w->check && wait_clock() - w->checked >= WAIT_CHECK_TICKS) {
+    w->check(w->check_arg);
+    w->checked = wait_clock();
+  }
+  switch (w->kind) {
+  case WAIT_PAUSE:
+    n = w->spins ? w->spins : 1;
+    for (i = 0; i < n && *slot == val; i++)
+      cpu_relax();
+    if (w->spins < PAUSE_BACKOFF_MAX)
+      w->spins = n * 2;
+    return 0;
+  case WAIT_YIELD:
+    sched_yield();
+    return 0;
+  case WAIT_FUTEX:
+    if (w->spins >= w->budget)
+      return 1;
+    w->spins++;
+    cpu_relax();
+    return 0;
+  case WAIT_UMWAIT:
+    umwait_while_equal(slot, val);
+    return 0;
+  case WAIT_ADAPTIVE:
+    if (w->slept)
+      return 1;
+    if (wait_clock() - w->start >= w->limit) {
+      w->slept = wait_clock();
+      return 1;
+    }
+    cpu_relax();
+    return 0;
+  }
+  return 0;
+}
+
+/* A simple flag word, for transports which don't need anything
+   cleverer: the waiter sets WAIT_SLEEPING in it before going to sleep
+   and the waker looks for it when it changes the word, so only the
+   strategies which sleep pay for the atomic. */
+#define WAIT_SLEEPING 0x80000000u
+
+/* Wait until the word, less WAIT_SLEEPING, isn't val, and return it */
+static inline unsigned
+wait_while_equal(struct waiter *w, volatile unsigned *slot, unsigned val)
+{
+  unsigned cur;
+
+  while (((cur = *slot) & ~WAIT_SLEEPING) == val) {
+    if (!wait_round(w, slot, cur))
+      continue;
+    if ((cur & WAIT_SLEEPING) ||
+	atomic_cmpxchg(slot, cur, cur | WAIT_SLEEPING) == cur)
+      waiter_sleep(w, slot, cur | WAIT_SLEEPING);
+  }
+  waiter_done(w);
+  return cur & ~WAIT_SLEEPING;
+}
+
+static inline void
+wake_with(int kind, volatile unsigned *slot, unsigned val)
+{
+  if (!wait_sleeps(kind)) {
+    asm volatile ("" : : : "memory");
+    *slot = val;
+  } else if (atomic_xchg(slot, val) & WAIT_SLEEPING) {
+    futex_wake(slot);
+  }
+}
+
+/* The same, for a word which more than one waiter might be asleep
+   on, each waiting for a different value */
+static inline void
+wake_all_with(int kind, volatile unsigned *slot, unsigned val)
+{
+  if (!wait_sleeps(kind)) {
+    asm volatile ("" : : : "memory");
+    *slot = val;
+  } else if (atomic_xchg(slot, val) & WAIT_SLEEPING) {
+    futex_wake_all(slot);
+  }
+}
+
 #endif /* !FUTEX_H__ */
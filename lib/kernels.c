@@ -0,0 +1,444 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define REPEAT_BYTE(b) ((unsigned long)((b) & 0xff) * 0x0101010101010101ul)
+
+static int
+always(void)
+{
+  return 1;
+}
+
+#if defined(__x86_64__)
+/* The structured extended feature flags */
+static unsigned
+cpuid7_ebx(void)
+{
+  unsigned a, b, c, d;
+
+  if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+    return 0;
+  return b;
+}
+#endif
+
+/* Whatever glibc thinks is best on this machine */
+static void
+glibc_fill(void *buf, int byte, size_t count)
+{
+  memset(buf, byte, count);
+}
+
+static void
+glibc_copy(void *dst, const void *src, size_t count)
+{
+  memcpy(dst, src, count);
+}
+
+/* There's no memchr for "a byte other than", but every byte is the
+   same as the first one iff the buffer matches itself shifted by
+   one. */
+static int
+glibc_check(const void *buf, int byte, size_t count)
+{
+  const unsigned char *p = buf;
+
+  if (!count)
+    return 0;
+  return p[0] != (unsigned char)byte || memcmp(p, p + 1, count - 1);
+}
+
+/* A word at a time, and stop the compiler from turning it back into
+   memset() or vectorising it. */
+#define SCALAR __attribute__((optimize("no-tree-vectorize", "no-tree-loop-distribute-patterns")))
+
+static SCALAR void
+scalar_fill(void *buf, int byte, size_t count)
+{
+  unsigned long *w = buf;
+  unsigned char *p;
+  size_t i;
+
+  for (i = 0; i < count / 8; i++)
+    w[i] = REPEAT_BYTE(byte);
+  for (p = (unsigned char *)(w + i); p < (unsigned char *)buf + count; p++)
+    *p = byte;
+}
+
+static SCALAR void
+scalar_copy(void *dst, const void *src, size_t count)
+{
+  unsigned long *d = dst;
+  const unsigned long *s = src;
+  size_t i;
+
+  for (i = 0; i < count / 8; i++)
+    d[i] = s[i];
+  for (i *= 8; i < count; i++)
+    ((unsigned char *)dst)[i] = ((const unsigned char *)src)[i];
+}
+
+static SCALAR int
+scalar_check(const void *buf, int byte, size_t count)
+{
+  const unsigned long *w = buf;
+  size_t i;
+
+  for (i = 0; i < count / 8; i++)
+    if (w[i] != REPEAT_BYTE(byte))
+      return 1;
+  for (i *= 8; i < count; i++)
+    if (((const unsigned char *)buf)[i] != (unsigned char)byte)
+      return 1;
+  return 0;
+}
+
+#if defined(__x86_64__) && defined(USE_INLINE_ASM)
+/* The string instructions.  With ERMS the byte forms are the fast
+   ones, and FSRM makes them fast for short strings too. */
+static int
+erms_supported(void)
+{
+  return !!(cpuid7_ebx() & (1 << 9));
+}
+
+static void
+erms_fill(void *buf, int byte, size_t count)
+{
+  asm volatile ("rep stosb\n"
+		: "+D" (buf), "+c" (count)
+		: "a" (byte)
+		: "memory");
+}
+
+static void
+erms_copy(void *dst, const void *src, size_t count)
+{
+  asm volatile ("rep movsb\n"
+		: "+D" (dst), "+S" (src), "+c" (count)
+		:
+		: "memory");
+}
+
+/* There's no fast scas, but repe scasq is what we've always used to
+   check. */
+static int
+erms_check(const void *buf, int byte, size_t count)
+{
+  unsigned long clobber;
+  const void *p = buf;
+  char result;
+
+  /* With nothing to scan, repe scasq leaves the flags as they were */
+  if (count < 8)
+    return scalar_check(buf, byte, count);
+  asm ("repe scasq\n"
+       "setne %%al\n"
+       : "=a" (result), "=c" (clobber), "+D" (p)
+       : "a" (REPEAT_BYTE(byte)), "1" (count / 8)
+       : "memory");
+  if (result)
+    return 1;
+  return scalar_check((const char *)buf + (count & ~7ul), byte, count & 7);
+}
+#endif
+
+#if defined(__x86_64__)
+static int
+avx2_supported(void)
+{
+  return __builtin_cpu_supports("avx2");
+}
+
+static __attribute__((target("avx2"))) void
+avx2_fill(void *buf, int byte, size_t count)
+{
+  __m256i v = _mm256_set1_epi8(byte);
+  char *p = buf;
+  size_t i;
+
+  for (i = 0; i + 32 <= count; i += 32)
+    _mm256_storeu_si256((__m256i *)(p + i), v);
+  scalar_fill(p + i, byte, count - i);
+}
+
+static __attribute__((target("avx2"))) void
+avx2_copy(void *dst, const void *src, size_t count)
+{
+  char *d = dst;
+  const char *s = src;
+  size_t i;
+
+  for (i = 0; i + 32 <= count; i += 32)
+    _mm256_storeu_si256((__m256i *)(d + i),
+			_mm256_loadu_si256((const __m256i *)(s + i)));
+  scalar_copy(d + i, s + i, count - i);
+}
+
+static __attribute__((target("avx2"))) int
+avx2_check(const void *buf, int byte, size_t count)
+{
+  __m256i v = _mm256_set1_epi8(byte);
+  const char *p = buf;
+  size_t i;
+
+  for (i = 0; i + 32 <= count; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, v)) != -1)
+      return 1;
+  }
+  return scalar_check(p + i, byte, count - i);
+}
+
+static int
+avx512_supported(void)
+{
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+/* Masked operations deal with the tail, so there's no scalar loop at
+   the end. */
+static inline __mmask64
+tail_mask(size_t n)
+{
+  return n >= 64 ? ~0ull : (1ull << n) - 1;
+}
+
+static __attribute__((target("avx512f,avx512bw"))) void
+avx512_fill(void *buf, int byte, size_t count)
+{
+  __m512i v = _mm512_set1_epi8(byte);
+  char *p = buf;
+  size_t i;
+
+  for (i = 0; i + 64 <= count; i += 64)
+    _mm512_storeu_si512(p + i, v);
+  if (i < count)
+    _mm512_mask_storeu_epi8(p + i, tail_mask(count - i), v);
+}
+
+static __attribute__((target("avx512f,avx512bw"))) void
+avx512_copy(void *dst, const void *src, size_t count)
+{
+  char *d = dst;
+  const char *s = src;
+  size_t i;
+
+  for (i = 0; i + 64 <= count; i += 64)
+    _mm512_storeu_si512(d + i, _mm512_loadu_si512(s + i));
+  if (i < count) {
+    __mmask64 m = tail_mask(count - i);
+    _mm512_mask_storeu_epi8(d + i, m, _mm512_maskz_loadu_epi8(m, s + i));
+  }
+}
+
+static __attribute__((target("avx512f,avx512bw"))) int
+avx512_check(const void *buf, int byte, size_t count)
+{
+  __m512i v = _mm512_set1_epi8(byte);
+  const char *p = buf;
+  size_t i;
+
+  for (i = 0; i + 64 <= count; i += 64)
+    if (_mm512_cmpneq_epu8_mask(_mm512_loadu_si512(p + i), v))
+      return 1;
+  if (i < count) {
+    __mmask64 m = tail_mask(count - i);
+    if (_mm512_mask_cmpneq_epu8_mask(m, _mm512_maskz_loadu_epi8(m, p + i), v))
+      return 1;
+  }
+  return 0;
+}
+#endif
+
+#if defined(__x86_64__)
+/* movntdq and movntdqa both want 16 byte alignment, so do the ragged
+   ends with ordinary accesses.  If source and destination disagree
+   about alignment then the stores win, and the loads are unaligned
+   and temporal. */
+static void
+stream_fill_sse(void *buf, int byte, size_t count)
+{
+  __m128i v = _mm_set1_epi8(byte);
+  char *p = buf;
+  size_t head = -(uintptr_t)p & 15;
+
+  if (head > count)
+    head = count;
+  memset(p, byte, head);
+  p += head;
+  count -= head;
+  for (; count >= 16; p += 16, count -= 16)
+    _mm_stream_si128((__m128i *)p, v);
+  memset(p, byte, count);
+  _mm_sfence();
+}
+
+static __attribute__((target("sse4.1"))) void
+stream_copy_sse(char *d, const char *s, size_t count, int nt_mode)
+{
+  size_t head;
+
+  if (nt_mode & NT_STORES)
+    head = -(uintptr_t)d & 15;
+  else
+    head = -(uintptr_t)s & 15;
+  if (head > count)
+    head = count;
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  count -= head;
+  if (nt_mode & NT_LOADS && !((uintptr_t)s & 15)) {
+    for (; count >= 16; d += 16, s += 16, count -= 16) {
+      /* movntdqa only really bypasses the cache for write-combining
+	 memory; on ordinary memory the prefetch hint is what keeps
+	 the source out of the outer caches. */
+      _mm_prefetch(s + 512, _MM_HINT_NTA);
+      __m128i x = _mm_stream_load_si128((__m128i *)s);
+      if (nt_mode & NT_STORES)
+	_mm_stream_si128((__m128i *)d, x);
+      else
+	_mm_storeu_si128((__m128i *)d, x);
+    }
+  } else {
+    for (; count >= 16; d += 16, s += 16, count -= 16)
+      _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+  }
+  memcpy(d, s, count);
+  _mm_sfence();
+}
+#endif
+
+int
+stream_supported(int nt_mode)
+{
+#if defined(__x86_64__)
+  if (nt_mode & NT_LOADS)
+    return __builtin_cpu_supports("sse4.1");
+  return 1;
+#else
+  return !nt_mode;
+#endif
+}
+
+void
+stream_fill(void *buf, int byte, size_t count)
+{
+#if defined(__x86_64__)
+  stream_fill_sse(buf, byte, count);
+#else
+  memset(buf, byte, count);
+#endif
+}
+
+void
+stream_copy(void *dst, const void *src, size_t count, int nt_mode)
+{
+#if defined(__x86_64__)
+  stream_copy_sse(dst, src, count, nt_mode);
+#else
+  memcpy(dst, src, count);
+#endif
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("clflushopt"))) void
+flush_range_opt(const char *c, const char *end)
+{
+  for (; c < end; c += 64)
+    _mm_clflushopt((void *)c);
+}
+#endif
+
+void
+flush_range(const void *p, size_t len)
+{
+#if defined(__x86_64__)
+  static int have_clflushopt = -1;
+  const char *c = (const char *)((uintptr_t)p & ~63ul);
+  const char *end = (const char *)p + len;
+
+  if (have_clflushopt < 0)
+    have_clflushopt = !!(cpuid7_ebx() & (1 << 23));
+  if (have_clflushopt) {
+    flush_range_opt(c, end);
+  } else {
+    for (; c < end; c += 64)
+      _mm_clflush(c);
+  }
+  /* clflushopt isn't ordered against much, so make sure that it's
+     done before we go and touch the lines again. */
+  _mm_mfence();
+#endif
+}
+
+const struct kernel kernels[] = {
+#if defined(__x86_64__)
+  { "avx512", avx512_supported, avx512_fill, avx512_copy, avx512_check },
+  { "avx2", avx2_supported, avx2_fill, avx2_copy, avx2_check },
+#endif
+#if defined(__x86_64__) && defined(USE_INLINE_ASM)
+  { "erms", erms_supported, erms_fill, erms_copy, erms_check },
+#endif
+  { "glibc", always, glibc_fill, glibc_copy, glibc_check },
+  { "scalar", always, scalar_fill, scalar_copy, scalar_check },
+  { NULL }
+};
+
+const struct kernel *
+find_kernel(const char *name)
+{
+  const struct kernel *k;
+
+  for (k = kernels; k->name; k++) {
+    if (!strcmp(name, "auto")) {
+      if (k->supported())
+	return k;
+    } else if (!strcmp(name, k->name)) {
+      return k->supported() ? k : NULL;
+    }
+  }
+  return NULL;
+}
+
+void
+list_kernels(FILE *f)
+{
+  const struct kernel *k;
+
+  for (k = kernels; k->name; k++)
+    fprintf(f, " %s%s", k->name, k->supported() ? "" : " (unsupported)");
+  fprintf(f, "\n");
+}
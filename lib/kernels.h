@@ -0,0 +1,64 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* The loops which touch the payload: filling it in on the way out,
+   copying it in and out of the transport's buffers, and checking it
+   on the way in.  Each kernel implements all three the same way, so
+   that we can see how much of a transport's throughput is really the
+   cost of moving the bytes about. */
+struct kernel {
+  const char *name;
+  int (*supported)(void);
+  void (*fill)(void *buf, int byte, size_t count);
+  void (*copy)(void *dst, const void *src, size_t count);
+  /* Non-zero if any byte of buf isn't byte */
+  int (*check)(const void *buf, int byte, size_t count);
+};
+
+/* Terminated by an entry with a NULL name, best first */
+extern const struct kernel kernels[];
+
+/* "auto" picks the best one this CPU can run.  NULL if there's no
+   such kernel or the CPU can't run it. */
+const struct kernel *find_kernel(const char *name);
+void list_kernels(FILE *f);
+
+/* Non-temporal versions, for messages so big that pulling them through
+   the cache would only evict things that someone else wanted.  These
+   don't depend on the kernel, and finish with an sfence, so that the
+   data is visible before whatever the caller publishes next. */
+#define NT_STORES 1
+#define NT_LOADS 2
+
+int stream_supported(int nt_mode);
+void stream_fill(void *buf, int byte, size_t count);
+void stream_copy(void *dst, const void *src, size_t count, int nt_mode);
+
+/* Write back and evict [p, p + len) from every level of the cache,
+   with clflushopt if we have it and clflush if not. */
+void flush_range(const void *p, size_t len);
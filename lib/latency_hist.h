@@ -0,0 +1,71 @@
+#ifndef LATENCY_HIST_H__
+#define LATENCY_HIST_H__
+
+/* Latencies in TSC ticks, to within an eighth of a power of two, in
+   a fixed-size lump which can live in shared memory so that whichever
+   end logs can see the other end's too. */
+#define HIST_SUB 3
+#define NR_HIST_BUCKETS (64 << HIST_SUB)
+
+struct latency_hist {
+  unsigned long count, sum, max;
+  unsigned long buckets[NR_HIST_BUCKETS];
+};
+
+static inline int
+hist_bucket(unsigned long v)
+{
+  int e;
+
+  if (v < (1 << HIST_SUB))
+    return v;
+  e = 63 - __builtin_clzl(v);
+  return ((e - HIST_SUB + 1) << HIST_SUB) +
+    ((v >> (e - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+}
+
+/* The smallest latency which lands in bucket b */
+static inline unsigned long
+hist_bucket_floor(int b)
+{
+  int e;
+
+  if (b < (1 << HIST_SUB))
+    return b;
+  e = (b >> HIST_SUB) + HIST_SUB - 1;
+  return (1ul << e) |
+    ((unsigned long)(b & ((1 << HIST_SUB) - 1)) << (e - HIST_SUB));
+}
+
+static inline void
+hist_add(struct latency_hist *h, unsigned long v)
+{
+  h->count++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+  h->buckets[hist_bucket(v)]++;
+}
+
+static inline double
+hist_mean(const struct latency_hist *h)
+{
+  return h->count ? (double)h->sum / h->count : 0;
+}
+
+/* p between 0 and 1 */
+static inline double
+hist_percentile(const struct latency_hist *h, double p)
+{
+  unsigned long want = h->count * p, seen = 0;
+  int b;
+
+  for (b = 0; b < NR_HIST_BUCKETS - 1; b++) {
+    seen += h->buckets[b];
+    if (seen > want)
+      break;
+  }
+  return hist_bucket_floor(b);
+}
+
+#endif /* !LATENCY_HIST_H__ */
@@ -27,7 +27,8 @@
 
 /* Ultimate in simple IPC protocols: establish a shared memory
    segment and then send a ping by setting flags in it, with the other
-   end spinning reading those flags.
+   end waiting for those flags to change, spinning unless -W says
+   otherwise.
    Note that this is a straight up latency test: no actual data is
    transferred. */
 
@@ -41,37 +42,59 @@
 
 #include "test.h"
 #include "xutil.h"
+#include "futex.h"
 
 #define PAGE_SIZE 4096
 
 struct shared_page {
-  int flag1;
+  unsigned flag1;
   int pad[127]; /* Make sure the two flags are in different cache lines
 		   for any conceivable size fo cache line. */
-  int flag2;
+  unsigned flag2;
 };
 
+/* -W, the same at both ends */
+static int wait_kind;
+static int spin_budget;
+/* Per-thread, since with -T both ends are in this process */
+static __thread struct spin_estimate est;
+
 static void
 init_test(test_data *td)
 {
-  td->data = establish_shm_segment(1, td->numa_node);
+  td->data = establish_test_segment(td, 1);
+}
+
+static void
+init_wait(test_data *td)
+{
+  wait_kind = td->wait_strategy < 0 ? WAIT_SPIN : td->wait_strategy;
+  spin_budget = td->spin_budget;
+  est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+}
+
+static void
+wait_while(volatile unsigned *flag, unsigned val)
+{
+  struct waiter w;
+
+  waiter_start(&w, wait_kind, spin_budget, &est);
+  wait_while_equal(&w, flag, val);
 }
 
 static void
 child_ping(test_data *td)
 {
   volatile struct shared_page *sp = td->data;
-  sp->flag1 = 1;
-  while (!sp->flag2)
-    ;
-  sp->flag1 = 0;
-  while (sp->flag2)
-    ;
+  wake_with(wait_kind, &sp->flag1, 1);
+  wait_while(&sp->flag2, 0);
+  wake_with(wait_kind, &sp->flag1, 0);
+  wait_while(&sp->flag2, 1);
 }
 
 static void child_finish(test_data *td) {
   volatile struct shared_page *sp = td->data;
-  sp->flag1 = 1;
+  wake_with(wait_kind, &sp->flag1, 1);
 }
 
 static void
@@ -79,21 +102,19 @@ parent_init(test_data *td)
 {
   volatile struct shared_page *sp = td->data;
 
+  init_wait(td);
   /* Wait for the child to get ready before starting the test. */
-  while (!sp->flag1)
-    ;
+  wait_while(&sp->flag1, 0);
 }
 
 static void parent_ping(test_data* td) {
 
   volatile struct shared_page *sp = td->data;
 
-  sp->flag2 = 1;
-  while (sp->flag1)
-    ;
-  sp->flag2 = 0;
-  while (!sp->flag1)
-    ;
+  wake_with(wait_kind, &sp->flag2, 1);
+  wait_while(&sp->flag1, 1);
+  wake_with(wait_kind, &sp->flag2, 0);
+  wait_while(&sp->flag1, 0);
 
 }
 
@@ -103,8 +124,11 @@ main(int argc, char *argv[])
   test_t t = { 
     .name = "mempipe_lat",
     .is_latency_test = 1,
+    .reusable = 1,
+    .wait_strategies = WAIT_ALL,
     .init_test = init_test, 
     .init_parent = parent_init,
+    .init_child = init_wait,
     .parent_ping = parent_ping,
     .child_ping = child_ping,
     .finish_child = child_finish
@@ -35,12 +35,19 @@
    read the packet out as soon as it does.  Once it's done so, it'll
    go back and set the finished flag in the header, so that the
    transmitter knows when it's safe to reuse a bit of buffer for a new
-   message.  The benchmark which we build on top of this just keeps
-   sending fixed-sized messages for soem number of times, waiting as
-   appropriate for the receiver to pick them up. */
+   message.  Messages can be any size; each one is packed in after the
+   last, with the next header starting on the next cache line.  The
+   benchmark which we build on top of this just keeps sending messages
+   for soem number of times, waiting as appropriate for the receiver
+   to pick them up. */
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef USE_EVENTFD
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <assert.h>
@@ -54,38 +61,103 @@
 #include <unistd.h>
 #include <sys/uio.h>
 
-#undef USE_MWAIT
-#ifndef NO_FUTEX
-#define USE_FUTEX
-#endif
-
 #include "test.h"
 #include "xutil.h"
-
-#ifdef Linux
-#include <linux/futex.h>
 #include "futex.h"
+
+/* mempipe_spin_thr is the same thing, but spins unless -W says
+   otherwise.  mempipe_eventfd_thr sleeps in epoll_wait() on an eventfd
+   rather than in futex_wait(); see "Doorbells" below. */
+#ifdef NO_FUTEX
+#define DEFAULT_WAIT WAIT_SPIN
+#else
+#define DEFAULT_WAIT WAIT_FUTEX
 #endif
 
 #define PAGE_SIZE 4096
 #define CACHE_LINE_SIZE 64
-static unsigned nr_shared_pages = 512;
+static int ring_order = 9;
+#define nr_shared_pages (1u << ring_order)
 #define ring_size (PAGE_SIZE * nr_shared_pages)
 
+/* How many messages ahead of the one it's reading the consumer
+   prefetches, or 0 not to, and whether to prefetch for write. */
+static int prefetch_distance;
+static int prefetch_write;
+/* Pack small messages in together; see "Packed framing" below */
+static int packed;
+/* The most publications we'll let share one futex wake, and the
+   longest we'll hold a wake back for; see "Wakeups" below. */
+static int wake_batch = 32;
+static int wake_us = 50;
+#ifdef USE_EVENTFD
+/* Send the consumer a datagram on a socket every this many messages,
+   or 0 not to */
+static int socket_every;
+#endif
+
+static tunable tunables[] = {
+  { "MEMPIPE_RING_ORDER", &ring_order, 0, 15 },
+  { "MEMPIPE_PREFETCH", &prefetch_distance, 0, 16 },
+  { "MEMPIPE_PREFETCH_WRITE", &prefetch_write, 0, 1 },
+  { "MEMPIPE_PACKED", &packed, 0, 1 },
+  { "MEMPIPE_WAKE_BATCH", &wake_batch, 1, 1024, 1 },
+  { "MEMPIPE_WAKE_US", &wake_us, 0, 100000, 1 },
+#ifdef USE_EVENTFD
+  { "MEMPIPE_SOCKET_EVERY", &socket_every, 0, 1 << 20, 1 },
+#endif
+  { NULL }
+};
+
+/* Lives in its own page in front of the ring, so that the start-up
+   handshake doesn't have to borrow a message header which the other
+   end might still be looking at from a previous run. */
+struct ring_control {
+#define RC_CHILD_READY 0xf008
+  unsigned handshake;
+  /* One for each end, 0 for the producer and 1 for the consumer */
+  struct {
+    /* What it's asleep on: a nap counter in the top half and one more
+       than the offset of the header in the bottom, or 0 if it's
+       awake */
+    unsigned long asleep;
+    unsigned long wake_tsc; /* When the other end last woke it */
+  } __attribute__((aligned(CACHE_LINE_SIZE))) end[2];
+  /* What each end's wakeups came to.  The child isn't supposed to
+     log anything, so the parent logs both. */
+  struct wake_stats {
+    unsigned long wakes, checks;
+    unsigned long held, max_held; /* TSC ticks between owing and waking */
+    unsigned long naps, woken_naps;
+    unsigned long wake_latency; /* From the other end's futex_wake() */
+    unsigned long waits, typical; /* How long they take, for WAIT_ADAPTIVE */
+    unsigned long polls; /* Returns from epoll_wait() */
+    unsigned long datagrams, dropped; /* On the socket, received or not sent */
+    unsigned batch;
+  } __attribute__((aligned(CACHE_LINE_SIZE))) stats[2];
+};
+
 struct msg_header {
 #define MH_FLAG_READY 1
 #define MH_FLAG_STOP 2
 #define MH_FLAG_WAITING 4
 #define MH_FLAGS (MH_FLAG_READY|MH_FLAG_STOP|MH_FLAG_WAITING)
+#define MH_SIZE_SHIFT 3 /* The size lives above the flags */
   unsigned size_and_flags;
   int pad[CACHE_LINE_SIZE / sizeof(int) - 1];
 };
 
 struct ring_state {
+  volatile struct ring_control *ctrl;
   void* ringmem;
   unsigned long next_tx_offset;
   unsigned long first_unacked_msg;
   unsigned long next_message_start;
+  int tx_size; /* Of the message between get_ and release_write_buffer */
+  int rx_size; /* Likewise for reads */
+  int tx_blk_bytes; /* Packed: records so far in the block we're filling */
+  int rx_blk_bytes; /* Packed: records in the block we're reading... */
+  int rx_pos; /* ...and how many of those bytes we've read */
   struct iovec vecs[2];
 };
 
@@ -95,160 +167,570 @@ mask_ring_index(unsigned long idx)
   return idx & (ring_size - 1);
 }
 
+/* How far a message of this size moves us along the ring */
+static unsigned long
+msg_stride(int size)
+{
+  return sizeof(struct msg_header) +
+    ((size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+}
+
+static int
+mh_size(unsigned size_and_flags)
+{
+  return size_and_flags >> MH_SIZE_SHIFT;
+}
+
+/* Point vecs at the size bytes at start, wrapping around the end of
+   the ring if need be. */
+static int
+ring_vecs(struct ring_state *rs, struct iovec *vecs, unsigned long start, int size)
+{
+  unsigned long offset = mask_ring_index(start);
+
+  vecs[0].iov_base = rs->ringmem + offset;
+  if (offset + size <= ring_size) {
+    vecs[0].iov_len = size;
+    return 1;
+  }
+  vecs[0].iov_len = ring_size - offset;
+  vecs[1].iov_base = rs->ringmem;
+  vecs[1].iov_len = size - (ring_size - offset);
+  return 2;
+}
+
+/* The message after the header at start */
+static int
+message_vecs(struct ring_state *rs, struct iovec *vecs, unsigned long start, int size)
+{
+  return ring_vecs(rs, vecs, start + sizeof(struct msg_header), size);
+}
+
+/* Packed framing.  A message of a few bytes doesn't need a whole cache
+   line of header, so with MEMPIPE_PACKED small messages share lines.
+   A block starts with the usual size_and_flags word, and only that
+   word, and is followed by records, each a 32-bit length and then the
+   message, padded to 4 bytes.  The producer adds records to the block
+   until the next one won't fit in its cache line and then publishes
+   them all with the one ready flag, so a message can wait for others
+   to fill its line before the consumer sees it.  A message too big to
+   share a line gets a block of its own.  The size in the flags word
+   is that of the records, so the block covers that plus the flags
+   word, rounded up to a cache line. */
+#define RECORD_ALIGN 4
+
+static unsigned long
+block_stride(int bytes)
+{
+  return (sizeof(unsigned) + bytes + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+}
+
+static int
+record_size(int len)
+{
+  return sizeof(uint32_t) + ((len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1));
+}
+
+/* How far the frame whose header says size moves us along the ring */
+static unsigned long
+frame_stride(int size)
+{
+  return packed ? block_stride(size) : msg_stride(size);
+}
+
+#ifdef USE_EVENTFD
+static void init_doorbells(void);
+#endif
+
 static void
 init_test(test_data *td)
 {
   struct ring_state* rs = (struct ring_state*)xmalloc(sizeof(struct ring_state));
-  rs->ringmem = establish_shm_segment(nr_shared_pages, td->numa_node);
+  rs->ctrl = establish_test_segment(td, nr_shared_pages + 1);
+  rs->ringmem = (void *)rs->ctrl + PAGE_SIZE;
   td->data = rs;
+  /* Once, before we fork, for the wake log */
+  get_tsc_freq();
+#ifdef USE_EVENTFD
+  init_doorbells();
+#endif
 }
 
-#ifdef USE_MWAIT
+/* Wakeups, when we wait with WAIT_FUTEX or WAIT_ADAPTIVE; the other
+   -W strategies never sleep, and so never need waking.  Publishing a
+   header is a plain store, which on x86 is already a release, and
+   most of the time nobody's asleep to need waking.  Someone who is
+   asleep has set MH_FLAG_WAITING in the header it's waiting on, so
+   the publisher reads the header before writing it and then owes the
+   sleeper a wake.  It doesn't have to pay straight away: if more
+   messages are coming then the sleeper might as well wake up to a few
+   of them at once.  So we hold the wake back until wk.batch more
+   publications have gone by or it's been wake_us, whichever's first,
+   and widen the batch each time the count runs out first and narrow
+   it each time the clock does, and drop it to 1 when publications
+   are further apart than wake_us and there's nothing coming to share
+   the wake with.  There's no timer, so the clock only gets looked at
+   when we publish; before we block ourselves, or finish, we pay
+   whatever we owe.
+
+   The catch with plain stores is that one can land between the
+   sleeper setting MH_FLAG_WAITING and going to sleep, and wipe the
+   flag out.  So the sleeper also says which header it's asleep on in
+   the ring_control, and every wk.batch publications, and before
+   blocking, the publisher fences and looks there for a sleeper on a
+   header which has lost its flag.
+
+   Per-thread, because in thread mode both ends of the pipe live in
+   the same process. */
+static __thread struct {
+  int kind, budget; /* How we wait, from -W */
+  struct spin_estimate est;
+  int me; /* Our ring_control end[] */
+  volatile struct wake_stats *st;
+  unsigned batch;
+  unsigned since_check; /* Publications since we last looked for a sleeper */
+  unsigned long woken; /* The last end[].asleep we woke... */
+  unsigned woken_header; /* ...and what its header said then */
+  volatile unsigned *owed; /* Someone's asleep on this and we've not woken them */
+  unsigned owed_msgs;
+  unsigned long owed_tsc, last_tsc;
+  unsigned long bound; /* wake_us in TSC ticks */
+  unsigned long start_tsc;
+#ifdef USE_EVENTFD
+  int epfd;
+  unsigned since_datagram;
+#endif
+} wk;
+
+#ifdef USE_EVENTFD
+/* Doorbells.  A service with an epoll loop can't sit in futex_wait(),
+   so here each end sleeps on an eventfd instead, which it can put in
+   its epoll set with whatever else it's waiting for, and the other
+   end wakes it by writing to it.  Everything else is as above: the
+   doorbell is only rung for a sleeper which has set MH_FLAG_WAITING,
+   or been found by check_for_sleeper(), and the rings are coalesced
+   in the same way.  Unlike a futex wake, a ring which arrives when
+   nobody's asleep isn't lost, but it only costs a spurious return
+   from epoll_wait() the next time round.
+
+   To show it sharing the loop, the consumer's epoll set also has one
+   end of a socketpair, and with MEMPIPE_SOCKET_EVERY the producer
+   sends a datagram on the other every so many messages.  The
+   consumer reads them whenever it's woken, as an event loop would,
+   and so only when the ring runs dry; the producer never blocks on
+   the socket, and counts what it couldn't send. */
+static int doorbell[2]; /* What each end sleeps on */
+static int side_socket[2]; /* Producer's end, consumer's end */
+
+#define DATAGRAM_SIZE 64
+
+/* Before the fork, so that both ends have them */
 static void
-mwait(void)
+init_doorbells(void)
 {
-  asm volatile("mwait\n"
-	       :
-	       : "a" (0), "c" (0));
+  doorbell[0] = eventfd(0, EFD_NONBLOCK);
+  doorbell[1] = eventfd(0, EFD_NONBLOCK);
+  if (doorbell[0] < 0 || doorbell[1] < 0)
+    err(1, "eventfd");
+  if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, side_socket) < 0)
+    err(1, "socketpair");
 }
+
+/* After it, so that each end has its own */
 static void
-monitor(const volatile void *what)
+start_doorbell(void)
 {
-  asm volatile("monitor\n"
-	       :
-	       : "a" (what),
-		 "c" (0),
-		 "d" (0)
-	       );
+  struct epoll_event ev;
+
+  wk.epfd = epoll_create1(0);
+  if (wk.epfd < 0)
+    err(1, "epoll_create1");
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = doorbell[wk.me];
+  if (epoll_ctl(wk.epfd, EPOLL_CTL_ADD, doorbell[wk.me], &ev) < 0)
+    err(1, "epoll_ctl");
+  if (wk.me == 1) {
+    ev.data.fd = side_socket[1];
+    if (epoll_ctl(wk.epfd, EPOLL_CTL_ADD, side_socket[1], &ev) < 0)
+      err(1, "epoll_ctl");
+  }
 }
-#else
+
 static void
-mwait(void)
+ring_doorbell(int end)
 {
+  uint64_t one = 1;
+
+  /* EAGAIN only if it's rung 2^64 - 2 times without an answer */
+  if (write(doorbell[end], &one, sizeof(one)) < 0 && errno != EAGAIN)
+    err(1, "ringing doorbell");
 }
+
 static void
-monitor(const volatile void *what)
+read_datagrams(void)
 {
+  char buf[DATAGRAM_SIZE];
+
+  while (recv(side_socket[1], buf, sizeof(buf), 0) >= 0)
+    wk.st->datagrams++;
+  if (errno != EAGAIN)
+    err(1, "recv");
+}
+
+static void
+send_datagram(void)
+{
+  char buf[DATAGRAM_SIZE];
+
+  memset(buf, 0, sizeof(buf));
+  if (send(side_socket[0], buf, sizeof(buf), 0) < 0) {
+    if (errno != EAGAIN)
+      err(1, "send");
+    wk.st->dropped++;
+  }
+}
+
+/* The event loop: sleep until the doorbell rings and *slot isn't val
+   any more, dealing with anything else which turns up meanwhile */
+static void
+wait_for_doorbell(volatile unsigned *slot, unsigned val)
+{
+  struct epoll_event evs[2];
+  uint64_t rung;
+  int i, n;
+
+  while (*slot == val) {
+    n = epoll_wait(wk.epfd, evs, 2, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      err(1, "epoll_wait");
+    }
+    wk.st->polls++;
+    for (i = 0; i < n; i++) {
+      if (evs[i].data.fd == side_socket[1])
+	read_datagrams();
+      else if (read(doorbell[wk.me], &rung, sizeof(rung)) < 0 && errno != EAGAIN)
+	err(1, "reading doorbell");
+    }
+  }
 }
 #endif
 
-/* Deferred write state */
-#ifdef USE_FUTEX
-static struct {
-  volatile unsigned *ptr;
-  unsigned val;
-  unsigned cntr;
-} deferred_write;
+/* Wake the other end, which is asleep on slot */
+static void
+wake_peer(volatile unsigned *slot)
+{
+#ifdef USE_EVENTFD
+  ring_doorbell(!wk.me);
+#else
+  futex_wake(slot);
+#endif
+}
 
 static void
-_set_message_ready(volatile unsigned *ptr, unsigned val)
+sleep_while_equal(volatile unsigned *slot, unsigned val)
 {
-  int sz;
-  sz = atomic_xchg(ptr, val);
-  if (sz & MH_FLAG_WAITING)
-    futex_wake(ptr);
+#ifdef USE_EVENTFD
+  wait_for_doorbell(slot, val);
+#else
+  futex_wait_while_equal(slot, val);
+#endif
 }
+
+static void
+send_wake(struct ring_state *rs, volatile unsigned *slot)
+{
+  /* Count it first, in case the parent's waiting for this to finish */
+  wk.st->wakes++;
+  rs->ctrl->end[!wk.me].wake_tsc = rdtsc();
+  wake_peer(slot);
+}
+
+static void
+pay_wake(struct ring_state *rs, unsigned long now)
+{
+  unsigned long held = now - wk.owed_tsc;
+
+  wk.st->held += held;
+  if (held > wk.st->max_held)
+    wk.st->max_held = held;
+  send_wake(rs, wk.owed);
+  wk.owed = NULL;
+}
+
+static void
+check_for_sleeper(struct ring_state *rs)
+{
+  volatile struct msg_header *mh;
+  unsigned long asleep;
+  unsigned header;
+
+  memory_barrier();
+  asleep = rs->ctrl->end[!wk.me].asleep;
+  wk.since_check = 0;
+  wk.st->checks++;
+  if (!asleep)
+    return;
+  mh = rs->ringmem + (unsigned)asleep - 1;
+  header = mh->size_and_flags;
+  /* If the flag's still there then we'll see it when we publish.  A
+     sleeper we've already woken only needs waking again once the
+     header's changed, as that can have been a store which wiped out
+     a flag it set after our wake. */
+  if ((header & MH_FLAG_WAITING) ||
+      (asleep == wk.woken && header == wk.woken_header))
+    return;
+  wk.woken = asleep;
+  wk.woken_header = header;
+  send_wake(rs, &mh->size_and_flags);
+}
+
+/* Pay what we owe, before we go to sleep or stop publishing */
+static void
+flush_wakes(struct ring_state *rs)
+{
+  if (wk.owed)
+    pay_wake(rs, rdtsc());
+  check_for_sleeper(rs);
+  wk.st->batch = wk.batch;
+}
+
+static void
+start_wakes(test_data *td, int me)
+{
+  struct ring_state* rs = (struct ring_state*)td->data;
+
+  memset(&wk, 0, sizeof(wk));
+  wk.kind = td->wait_strategy < 0 ? DEFAULT_WAIT : td->wait_strategy;
+  wk.budget = td->spin_budget;
+  wk.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  wk.me = me;
+  wk.st = &rs->ctrl->stats[me];
+  memset((void *)wk.st, 0, sizeof(*wk.st));
+  wk.batch = 1;
+  wk.bound = wake_us * get_tsc_freq() / 1e6;
+  wk.start_tsc = wk.last_tsc = rdtsc();
+#ifdef USE_EVENTFD
+  start_doorbell();
 #endif
+}
 
-static int
-wait_for_message_ready(volatile struct msg_header *mh, int desired_state)
+static void
+log_wakes(test_data *td, struct ring_state *rs)
 {
-  int sz;
-#ifdef USE_FUTEX
-  int new_sz;
-  if (deferred_write.ptr) {
-    _set_message_ready(deferred_write.ptr, deferred_write.val);
-    deferred_write.ptr = NULL;
+  double freq = get_tsc_freq();
+  double secs = (rdtsc() - wk.start_tsc) / freq;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    volatile struct wake_stats *st = &rs->ctrl->stats[i];
+    logmsg(td, "wakes",
+	   "%s %s %d wakes %lu %.0f/s checks %lu held mean %.2fus max %.2fus "
+	   "naps %lu woken %lu latency %.2fus waits %lu typical %.2fus "
+	   "batch %u\n",
+	   td->name, i ? "consumer" : "producer", td->size,
+	   st->wakes, st->wakes / secs, st->checks,
+	   st->wakes ? st->held / (st->wakes * freq) * 1e6 : 0,
+	   st->max_held / freq * 1e6, st->naps, st->woken_naps,
+	   st->woken_naps ? st->wake_latency / (st->woken_naps * freq) * 1e6 : 0,
+	   st->waits, st->typical / freq * 1e6, st->batch);
+#ifdef USE_EVENTFD
+    logmsg(td, "epoll", "%s %s %d polls %lu %.0f/s datagrams %lu dropped %lu\n",
+	   td->name, i ? "consumer" : "producer", td->size, st->polls,
+	   st->polls / secs, st->datagrams, st->dropped);
+#endif
   }
+}
+
+static int
+wait_for_message_ready(struct ring_state *rs, volatile struct msg_header *mh,
+		       int desired_state)
+{
+  volatile unsigned long *asleep = &rs->ctrl->end[wk.me].asleep;
+  unsigned long slept, woke;
+  struct waiter w;
+  int sz, new_sz;
+
+  sz = mh->size_and_flags;
+  if ((sz & MH_FLAG_READY) == desired_state)
+    return sz;
+  /* Whoever we're waiting for might be waiting for us */
+  if (wait_sleeps(wk.kind))
+    flush_wakes(rs);
+  waiter_start(&w, wk.kind, wk.budget, &wk.est);
   while (1) {
     sz = mh->size_and_flags;
     if ((sz & MH_FLAG_READY) == desired_state)
       break;
+    if (!wait_round(&w, &mh->size_and_flags, sz))
+      continue;
+    if (!*asleep) {
+      /* Look again once it's there for the publisher to see */
+      *asleep = (++wk.st->naps << 32) | ((void *)mh - rs->ringmem + 1);
+      continue;
+    }
     new_sz = sz | MH_FLAG_WAITING;
     if (new_sz == sz ||
-	atomic_cmpxchg(&mh->size_and_flags, sz, new_sz) == sz)
-      futex_wait_while_equal(&mh->size_and_flags, new_sz);
-  }
-#else
-  sz = mh->size_and_flags;
-  if ((sz & MH_FLAG_READY) != desired_state) {
-    while (1) {
-      monitor(&mh->size_and_flags);
-      sz = mh->size_and_flags;
-      if ((sz & MH_FLAG_READY) == desired_state)
-	break;
-      mwait();
+	atomic_cmpxchg(&mh->size_and_flags, sz, new_sz) == sz) {
+      slept = rdtsc();
+      sleep_while_equal(&mh->size_and_flags, new_sz);
+      woke = rs->ctrl->end[wk.me].wake_tsc;
+      if (woke > slept) {
+	wk.st->woken_naps++;
+	wk.st->wake_latency += rdtsc() - woke;
+      }
     }
   }
-#endif
+  *asleep = 0;
+  waiter_done(&w);
+  wk.st->waits++;
+  wk.st->typical = wk.est.typical;
   return sz;
 }
 
 static void
-set_message_ready(volatile struct msg_header *mh, int size)
-{
-#ifdef USE_FUTEX
-  if (deferred_write.ptr) {
-    deferred_write.cntr--;
-    mh->size_and_flags = size;
-    if (!deferred_write.cntr) {
-      _set_message_ready(deferred_write.ptr, deferred_write.val);
-      deferred_write.ptr = NULL;
-    }
-  } else {
-    deferred_write.ptr = &mh->size_and_flags;
-    deferred_write.val = size;
-    deferred_write.cntr = 2;
-  }
-#else
+set_message_ready(struct ring_state *rs, volatile struct msg_header *mh, int size)
+{
+  unsigned old = mh->size_and_flags;
+  unsigned long now;
+
+  asm volatile ("" : : : "memory");
   mh->size_and_flags = size;
+#ifdef USE_EVENTFD
+  if (socket_every && (size & MH_FLAG_READY) && ++wk.since_datagram >= socket_every) {
+    wk.since_datagram = 0;
+    send_datagram();
+  }
 #endif
+  if (!wait_sleeps(wk.kind))
+    return;
+  now = rdtsc();
+  if (now - wk.last_tsc > wk.bound)
+    wk.batch = 1;
+  wk.last_tsc = now;
+  if (old & MH_FLAG_WAITING) {
+    if (wk.owed)
+      pay_wake(rs, now);
+    wk.owed = &mh->size_and_flags;
+    wk.owed_tsc = now;
+    wk.owed_msgs = 0;
+  } else if (++wk.since_check >= wk.batch) {
+    check_for_sleeper(rs);
+  }
+  if (!wk.owed)
+    return;
+  if (++wk.owed_msgs >= wk.batch) {
+    wk.batch = wk.batch * 2 < wake_batch ? wk.batch * 2 : wake_batch;
+    pay_wake(rs, now);
+  } else if (now - wk.owed_tsc >= wk.bound) {
+    if (wk.batch > 1)
+      wk.batch /= 2;
+    pay_wake(rs, now);
+  }
 }
 
 static void
 init_child(test_data *td)
 {
   struct ring_state* rs = (struct ring_state*)td->data;
-  volatile struct msg_header *mh = rs->ringmem;
 
   /* Sync up with parent */
-  mh->size_and_flags = 0xf008;
-  while (mh->size_and_flags == 0xf008)
+  rs->ctrl->handshake = RC_CHILD_READY;
+  while (rs->ctrl->handshake == RC_CHILD_READY)
     ;
 
   rs->next_message_start = 0;
+  rs->rx_blk_bytes = 0;
+  start_wakes(td, 1);
   /* Enter main message loop */
 }
 
+/* Start fetching the message which will start at start, so that
+   the transfer from the producer's cache overlaps with whatever we do
+   with the current one.  If it hasn't been written yet then we'll
+   have fetched it for nothing, which is why this is a tunable. */
+static void
+prefetch_message(struct ring_state *rs, unsigned long start, int size)
+{
+  unsigned long offset = mask_ring_index(start + sizeof(struct msg_header));
+
+  prefetch_range(rs->ringmem + mask_ring_index(start), sizeof(struct msg_header),
+		 prefetch_write);
+  if (offset + size <= ring_size) {
+    prefetch_range(rs->ringmem + offset, size, prefetch_write);
+  } else {
+    prefetch_range(rs->ringmem + offset, ring_size - offset, prefetch_write);
+    prefetch_range(rs->ringmem, size - (ring_size - offset), prefetch_write);
+  }
+}
+
+static struct iovec*
+packed_get_read_buffer(struct ring_state *rs, int *n_vecs)
+{
+  unsigned long start;
+  uint32_t len;
+
+  if (!rs->rx_blk_bytes) {
+    volatile struct msg_header *mh;
+    int sz;
+    mh = rs->ringmem + mask_ring_index(rs->next_message_start);
+    sz = wait_for_message_ready(rs, mh, MH_FLAG_READY);
+    if (sz & MH_FLAG_STOP) {
+      *n_vecs = 0;
+      return 0;
+    }
+    rs->rx_blk_bytes = mh_size(sz);
+    rs->rx_pos = 0;
+  }
+  start = rs->next_message_start + sizeof(unsigned) + rs->rx_pos;
+  len = *(uint32_t *)(rs->ringmem + mask_ring_index(start));
+  if (rs->rx_pos + record_size(len) > rs->rx_blk_bytes)
+    errx(1, "%u byte record runs off the end of its block", len);
+  rs->rx_size = len;
+  *n_vecs = ring_vecs(rs, rs->vecs, start + sizeof(uint32_t), len);
+  return rs->vecs;
+}
+
+/* Give the block back once we've read everything in it */
+static void
+packed_release_read_buffer(struct ring_state *rs)
+{
+  volatile struct msg_header *mh;
+
+  rs->rx_pos += record_size(rs->rx_size);
+  if (rs->rx_pos < rs->rx_blk_bytes)
+    return;
+  mh = rs->ringmem + mask_ring_index(rs->next_message_start);
+  set_message_ready(rs, mh, rs->rx_blk_bytes << MH_SIZE_SHIFT);
+  rs->next_message_start += block_stride(rs->rx_blk_bytes);
+  rs->rx_blk_bytes = 0;
+}
+
 static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
 
   struct ring_state* rs = (struct ring_state*)td->data;
   volatile struct msg_header *mh;
   int sz;
   assert(rs->next_message_start % CACHE_LINE_SIZE == 0);
+  if (packed)
+    return packed_get_read_buffer(rs, n_vecs);
   mh = rs->ringmem + mask_ring_index(rs->next_message_start);
-  sz = wait_for_message_ready(mh, MH_FLAG_READY);
+  sz = wait_for_message_ready(rs, mh, MH_FLAG_READY);
   if (sz & MH_FLAG_STOP) { /* End of test */
     *n_vecs = 0;
     return 0;
   }
-  sz &= ~MH_FLAGS;
-  if(sz != td->size) {
-    exit(1);
-  }
-  unsigned long offset = mask_ring_index(rs->next_message_start + sizeof(struct msg_header));
-  if (offset + td->size <= ring_size) {
-    rs->vecs[0].iov_base = rs->ringmem + offset;
-    rs->vecs[0].iov_len = td->size;
-    *n_vecs = 1;
-  }
-  else {
-    rs->vecs[0].iov_base = rs->ringmem + offset;
-    rs->vecs[0].iov_len = ring_size - offset;
-    rs->vecs[1].iov_base = rs->ringmem;
-    rs->vecs[1].iov_len = td->size - (ring_size - offset);
-    *n_vecs = 2;
-  }
+  rs->rx_size = mh_size(sz);
+  *n_vecs = message_vecs(rs, rs->vecs, rs->next_message_start, rs->rx_size);
+
+  /* We can't know where later messages start until we get to them,
+     so guess that they're the same size as this one. */
+  if (prefetch_distance)
+    prefetch_message(rs, rs->next_message_start +
+		     prefetch_distance * msg_stride(rs->rx_size),
+		     rs->rx_size);
 
   return rs->vecs;
 
@@ -258,18 +740,26 @@ static void release_read_buffer(test_data* td, struct iovec* vecs, int n_vecs) {
 
   struct ring_state* rs = (struct ring_state*)td->data;
   volatile struct msg_header *mh = rs->ringmem + mask_ring_index(rs->next_message_start);
-  
-  set_message_ready(mh, td->size);
 
-  rs->next_message_start += td->size + sizeof(struct msg_header);
+  if (packed) {
+    packed_release_read_buffer(rs);
+    return;
+  }
+  set_message_ready(rs, mh, rs->rx_size << MH_SIZE_SHIFT);
+
+  rs->next_message_start += msg_stride(rs->rx_size);
 
 }
 
 static void child_finish(test_data* td) {
 
-#ifdef USE_FUTEX
-  if(deferred_write.ptr)
-    _set_message_ready(deferred_write.ptr, deferred_write.val);
+  struct ring_state* rs = (struct ring_state*)td->data;
+
+  /* The producer might be waiting for the last few messages back */
+  if (wait_sleeps(wk.kind))
+    flush_wakes(rs);
+#ifdef USE_EVENTFD
+  close(wk.epfd);
 #endif
 
 }
@@ -280,52 +770,107 @@ init_parent(test_data *td)
   struct ring_state* rs = (struct ring_state*)td->data;
   volatile struct msg_header *mh = rs->ringmem;
 
-  assert(td->size < ring_size - sizeof(struct msg_header));
-
-  /* Wait for child to show up. */
-  while (mh->size_and_flags != 0xf008)
+  /* Wait for child to show up, and make sure that it'll wait for
+     the first message rather than picking up whatever a previous run
+     left in the first header. */
+  while (rs->ctrl->handshake != RC_CHILD_READY)
     ;
   mh->size_and_flags = 0;
+  rs->ctrl->handshake = 0;
 
   rs->next_tx_offset = 0;
   rs->first_unacked_msg = 0;
+  rs->tx_blk_bytes = 0;
+  start_wakes(td, 0);
+}
+
+/* Room for the message, and the next header; the harness splits
+   anything bigger up for us. */
+static int
+max_fragment(test_data *td)
+{
+  return ring_size - 2 * sizeof(struct msg_header);
+}
+
+/* Wait for the receiver to finish with the oldest message it hasn't
+   given back yet. */
+static void
+reclaim_message(struct ring_state *rs)
+{
+  volatile struct msg_header *mh;
 
-  /* Round up to multiple of cache line size, for sanity. */
-  td->size = td->size + CACHE_LINE_SIZE - 1;
-  td->size -= td->size % CACHE_LINE_SIZE;
+  mh = rs->ringmem + mask_ring_index(rs->first_unacked_msg);
+  rs->first_unacked_msg += frame_stride(mh_size(wait_for_message_ready(rs, mh, 0)));
+}
+
+/* Publish the block we've been filling, which starts at
+   next_tx_offset, clearing the header after it first as
+   release_write_buffer() does. */
+static void
+publish_block(struct ring_state *rs)
+{
+  volatile struct msg_header *mh;
+  volatile struct msg_header *mh2;
+  unsigned long stride = block_stride(rs->tx_blk_bytes);
+
+  mh = rs->ringmem + mask_ring_index(rs->next_tx_offset);
+  mh2 = rs->ringmem + mask_ring_index(rs->next_tx_offset + stride);
+  mh2->size_and_flags = 0;
+  set_message_ready(rs, mh, (rs->tx_blk_bytes << MH_SIZE_SHIFT) | MH_FLAG_READY);
+  rs->next_tx_offset += stride;
+  rs->tx_blk_bytes = 0;
+}
+
+static struct iovec*
+packed_get_write_buffer(struct ring_state *rs, int len, int *n_vecs)
+{
+  unsigned long start;
+
+  if (rs->tx_blk_bytes &&
+      block_stride(rs->tx_blk_bytes + record_size(len)) > CACHE_LINE_SIZE)
+    publish_block(rs);
+  /* A new block needs room, as a message does; adding to a block
+     doesn't take it past the line it's already got. */
+  if (!rs->tx_blk_bytes) {
+    unsigned long eom = rs->next_tx_offset + block_stride(record_size(len)) +
+      sizeof(struct msg_header);
+    while (eom - rs->first_unacked_msg > ring_size)
+      reclaim_message(rs);
+  }
+  start = rs->next_tx_offset + sizeof(unsigned) + rs->tx_blk_bytes;
+  *(uint32_t *)(rs->ringmem + mask_ring_index(start)) = len;
+  rs->tx_size = len;
+  *n_vecs = ring_vecs(rs, rs->vecs, start + sizeof(uint32_t), len);
+  return rs->vecs;
+}
+
+/* Publish as soon as the block can't take even the smallest message */
+static void
+packed_release_write_buffer(struct ring_state *rs)
+{
+  rs->tx_blk_bytes += record_size(rs->tx_size);
+  if (block_stride(rs->tx_blk_bytes + record_size(1)) > CACHE_LINE_SIZE)
+    publish_block(rs);
 }
 
 struct iovec*
 get_write_buffer(test_data* td, int len, int* n_vecs) {
 
   struct ring_state* rs = (struct ring_state*)td->data;
-  volatile struct msg_header *mh;
 
-  assert(len == td->size);
+  if (packed)
+    return packed_get_write_buffer(rs, len, n_vecs);
 
-  /* Check for available ring space (eom = end of message) */
-  unsigned long eom = rs->next_tx_offset + td->size + sizeof(struct msg_header) * 2;
-  while (eom - rs->first_unacked_msg > ring_size) {
-    int size;
-    mh = rs->ringmem + mask_ring_index(rs->first_unacked_msg);
-    size = wait_for_message_ready(mh, 0);
-    size &= ~MH_FLAGS;
-    rs->first_unacked_msg += size + sizeof(struct msg_header);
-  }
+  assert(msg_stride(len) + sizeof(struct msg_header) <= ring_size);
 
-  unsigned long offset = mask_ring_index(rs->next_tx_offset + sizeof(struct msg_header));
-  if (offset + td->size <= ring_size) {
-    rs->vecs[0].iov_base = rs->ringmem + offset;
-    rs->vecs[0].iov_len = td->size;
-    *n_vecs = 1;
-  } else {
-    rs->vecs[0].iov_base = rs->ringmem + offset;
-    rs->vecs[0].iov_len = ring_size - offset;
-    rs->vecs[1].iov_base = rs->ringmem;
-    rs->vecs[1].iov_len = td->size - (ring_size - offset);
-    *n_vecs = 2;
-  }
+  /* Check for available ring space (eom = end of message, plus the
+     next header) */
+  unsigned long eom = rs->next_tx_offset + msg_stride(len) + sizeof(struct msg_header);
+  while (eom - rs->first_unacked_msg > ring_size)
+    reclaim_message(rs);
 
+  rs->tx_size = len;
+  *n_vecs = message_vecs(rs, rs->vecs, rs->next_tx_offset, len);
   return rs->vecs;
 
 }
@@ -337,6 +882,11 @@ void release_write_buffer(test_data* td, struct iovec* vecs, int nvecs) {
   volatile struct msg_header *mh2;
   assert(vecs == rs->vecs);
 
+  if (packed) {
+    packed_release_write_buffer(rs);
+    return;
+  }
+
   /* Send message */
   mh = rs->ringmem + mask_ring_index(rs->next_tx_offset);
 
@@ -345,73 +895,185 @@ void release_write_buffer(test_data* td, struct iovec* vecs, int nvecs) {
      sure that the receiver stops and spins in the right place,
      rather than wandering off into la-la land if it picks up a
      stale message. */
-  mh2 = rs->ringmem + mask_ring_index(rs->next_tx_offset + td->size + sizeof(struct msg_header));
+  mh2 = rs->ringmem + mask_ring_index(rs->next_tx_offset + msg_stride(rs->tx_size));
   mh2->size_and_flags = 0;
   
-  set_message_ready(mh, td->size | MH_FLAG_READY);
+  set_message_ready(rs, mh, (rs->tx_size << MH_SIZE_SHIFT) | MH_FLAG_READY);
   
-  rs->next_tx_offset += td->size + sizeof(struct msg_header);
+  rs->next_tx_offset += msg_stride(rs->tx_size);
 
 }
 
-void parent_finish(test_data* td) {
+/* Batches.  The producer fills in every header of a batch but the
+   first, and then publishes the lot by setting the first; the
+   consumer gives them back the same way.  Nobody waits on any header
+   but the first, so the others can be plain stores.  Packed framing
+   already shares one flag between the messages in a line, so there a
+   batch is just one message. */
 
-  struct ring_state* rs = (struct ring_state*)td->data;
+/* Reclaim the oldest message if the receiver's finished with it,
+   without waiting if it hasn't. */
+static int
+try_reclaim_message(struct ring_state *rs)
+{
   volatile struct msg_header *mh;
+  unsigned sz;
 
-  mh = rs->ringmem + mask_ring_index(rs->next_tx_offset);
-  mh->size_and_flags = MH_FLAG_READY | MH_FLAG_STOP;
-#ifdef USE_FUTEX
-  futex_wake(&mh->size_and_flags);
-#endif
+  if (rs->first_unacked_msg == rs->next_tx_offset)
+    return 0;
+  mh = rs->ringmem + mask_ring_index(rs->first_unacked_msg);
+  sz = mh->size_and_flags;
+  if (sz & MH_FLAG_READY)
+    return 0;
+  rs->first_unacked_msg += frame_stride(mh_size(sz));
+  return 1;
+}
 
-  /* Wait for child to acknowledge receipt of all messages */
-  while (rs->first_unacked_msg != rs->next_tx_offset) {
-    int size;
-    mh = rs->ringmem + mask_ring_index(rs->first_unacked_msg);
-    size = wait_for_message_ready(mh, 0);
-    size &= ~MH_FLAGS;
-    rs->first_unacked_msg += size + sizeof(struct msg_header);
-  }
+static int
+get_write_batch(test_data *td, struct batch_msg *msgs, int nr)
+{
+  struct ring_state* rs = (struct ring_state*)td->data;
+  unsigned long start = rs->next_tx_offset;
+  int k;
 
+  if (packed) {
+    struct iovec *vecs = packed_get_write_buffer(rs, msgs[0].size, &msgs[0].n_vecs);
+    memcpy(msgs[0].vecs, vecs, msgs[0].n_vecs * sizeof(vecs[0]));
+    return 1;
+  }
+  for (k = 0; k < nr; k++) {
+    unsigned long eom = start + msg_stride(msgs[k].size) + sizeof(struct msg_header);
+    /* Wait for room for the first, and take as many more as there's
+       room for already */
+    while (eom - rs->first_unacked_msg > ring_size) {
+      if (k == 0)
+	reclaim_message(rs);
+      else if (!try_reclaim_message(rs))
+	return k;
+    }
+    msgs[k].n_vecs = message_vecs(rs, msgs[k].vecs, start, msgs[k].size);
+    start += msg_stride(msgs[k].size);
+  }
+  return k;
 }
 
-#ifdef USE_MWAIT
 static void
-cpuid(int leaf, unsigned long *a, unsigned long *b, unsigned long *c, unsigned long *d)
-{
-  unsigned long _a, _b, _c, _d;
-  asm ("cpuid"
-       : "=a" (_a), "=b" (_b), "=c" (_c), "=d" (_d)
-       : "0" (leaf)
-       );
-  if (a)
-    *a = _a;
-  if (b)
-    *b = _b;
-  if (c)
-    *c = _c;
-  if (d)
-    *d = _d;
+release_write_batch(test_data *td, struct batch_msg *msgs, int nr)
+{
+  struct ring_state* rs = (struct ring_state*)td->data;
+  unsigned long offset = rs->next_tx_offset;
+  volatile struct msg_header *mh;
+  int k;
+
+  if (packed) {
+    packed_release_write_buffer(rs);
+    return;
+  }
+  for (k = 0; k < nr; k++)
+    offset += msg_stride(msgs[k].size);
+  /* Stop the receiver after the batch, as in release_write_buffer() */
+  mh = rs->ringmem + mask_ring_index(offset);
+  mh->size_and_flags = 0;
+
+  offset = rs->next_tx_offset + msg_stride(msgs[0].size);
+  for (k = 1; k < nr; k++) {
+    mh = rs->ringmem + mask_ring_index(offset);
+    mh->size_and_flags = (msgs[k].size << MH_SIZE_SHIFT) | MH_FLAG_READY;
+    offset += msg_stride(msgs[k].size);
+  }
+  mh = rs->ringmem + mask_ring_index(rs->next_tx_offset);
+  set_message_ready(rs, mh, (msgs[0].size << MH_SIZE_SHIFT) | MH_FLAG_READY);
+
+  rs->next_tx_offset = offset;
 }
 
-static void
-check_monitor_line_size(void)
+static int
+get_read_batch(test_data *td, struct batch_msg *msgs, int nr)
 {
-  unsigned long a, b, c;
-  cpuid(5, &a, &b, NULL, NULL);
-  assert(a == b);
-  assert(a == CACHE_LINE_SIZE);
-  cpuid(1, NULL, NULL, &c, NULL);
-  printf("Available: %d\n", !!(c & (1 << 3)));
+  struct ring_state* rs = (struct ring_state*)td->data;
+  unsigned long start = rs->next_message_start;
+  volatile struct msg_header *mh;
+  int sz;
+  int k;
+
+  if (packed) {
+    struct iovec *vecs = packed_get_read_buffer(rs, &msgs[0].n_vecs);
+    if (!vecs)
+      return 0;
+    msgs[0].size = rs->rx_size;
+    memcpy(msgs[0].vecs, vecs, msgs[0].n_vecs * sizeof(vecs[0]));
+    return 1;
+  }
+  mh = rs->ringmem + mask_ring_index(start);
+  sz = wait_for_message_ready(rs, mh, MH_FLAG_READY);
+  for (k = 0; k < nr; k++) {
+    /* Anything already sent comes too */
+    if (k) {
+      mh = rs->ringmem + mask_ring_index(start);
+      sz = mh->size_and_flags;
+      if (!(sz & MH_FLAG_READY))
+	break;
+    }
+    if (sz & MH_FLAG_STOP)
+      break;
+    msgs[k].size = mh_size(sz);
+    msgs[k].n_vecs = message_vecs(rs, msgs[k].vecs, start, msgs[k].size);
+    start += msg_stride(msgs[k].size);
+  }
+  return k;
 }
-#else
+
 static void
-check_monitor_line_size(void)
+release_read_batch(test_data *td, struct batch_msg *msgs, int nr)
 {
+  struct ring_state* rs = (struct ring_state*)td->data;
+  unsigned long offset = rs->next_message_start + msg_stride(msgs[0].size);
+  volatile struct msg_header *mh;
+  int k;
+
+  if (packed) {
+    packed_release_read_buffer(rs);
+    return;
+  }
+  for (k = 1; k < nr; k++) {
+    mh = rs->ringmem + mask_ring_index(offset);
+    mh->size_and_flags = msgs[k].size << MH_SIZE_SHIFT;
+    offset += msg_stride(msgs[k].size);
+  }
+  mh = rs->ringmem + mask_ring_index(rs->next_message_start);
+  set_message_ready(rs, mh, msgs[0].size << MH_SIZE_SHIFT);
+
+  rs->next_message_start = offset;
 }
+
+void parent_finish(test_data* td) {
+
+  struct ring_state* rs = (struct ring_state*)td->data;
+  volatile struct msg_header *mh;
+
+  if (packed && rs->tx_blk_bytes)
+    publish_block(rs);
+  if (wait_sleeps(wk.kind))
+    flush_wakes(rs);
+  mh = rs->ringmem + mask_ring_index(rs->next_tx_offset);
+  mh->size_and_flags = MH_FLAG_READY | MH_FLAG_STOP;
+  if (wait_sleeps(wk.kind))
+    wake_peer(&mh->size_and_flags);
+
+  /* Wait for child to acknowledge receipt of all messages */
+  while (rs->first_unacked_msg != rs->next_tx_offset)
+    reclaim_message(rs);
+
+  if (wait_sleeps(wk.kind)) {
+    wk.st->batch = wk.batch;
+    log_wakes(td, rs);
+  }
+#ifdef USE_EVENTFD
+  close(wk.epfd);
 #endif
 
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -419,9 +1081,18 @@ main(int argc, char *argv[])
     .name = "mempipe_"
 #ifdef NO_FUTEX
     "spin_"
+#endif
+#ifdef USE_EVENTFD
+    "eventfd_"
 #endif
     "thr",
     .is_latency_test = 0,
+    .data_size = sizeof(struct ring_state),
+    .reusable = 1,
+    .variable_size = 1,
+    .max_fragment = max_fragment,
+    .tunables = tunables,
+    .wait_strategies = WAIT_ALL,
     .init_test = init_test,
     .init_parent = init_parent,
     .finish_parent = parent_finish,
@@ -430,18 +1101,12 @@ main(int argc, char *argv[])
     .get_write_buffer = get_write_buffer,
     .release_write_buffer = release_write_buffer,
     .get_read_buffer = get_read_buffer,
-    .release_read_buffer = release_read_buffer
+    .release_read_buffer = release_read_buffer,
+    .get_write_batch = get_write_batch,
+    .release_write_batch = release_write_batch,
+    .get_read_batch = get_read_batch,
+    .release_read_batch = release_read_batch
   };
-  char *ring_order = getenv("MEMPIPE_RING_ORDER");
-  check_monitor_line_size();
-  if (ring_order) {
-    int as_int;
-    if (sscanf(ring_order, "%d", &as_int) != 1)
-      err(1, "MEMPIPE_RING_ORDER must be an integer");
-    if (as_int < 0 || as_int > 15)
-      errx(1, "MEMPIPE_RING_ORDER must be between 0 and 15");
-    nr_shared_pages = 1 << as_int;
-  }
   run_test(argc, argv, &t);
   return 0;
 }
@@ -0,0 +1,844 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* A bounded queue which any number of producers and consumers can
+   share, for handing work out.  It's Dmitry Vyukov's: a power of two
+   cells, each with a sequence number, and head and tail counters
+   which producers and consumers move on with compare-and-swap.  Cell
+   pos & mask is free for the producer at pos when its sequence number
+   is pos, full for the consumer at pos once it's pos + 1, and free
+   again for the next lap at pos + nr_cells.  Whoever finds the cell
+   at their counter in the right state tries to move the counter on,
+   and if someone else got there first tries again at the new one;
+   a cell in the wrong state means the queue's full or empty.
+
+   Messages either live in the cells themselves or, with
+   MPMC_EXTENTS=1, in a data area of their own, with the cells only
+   saying where: extents go round between the producers and
+   consumers on a second queue of the same kind, so that a producer
+   which takes a while over a big message doesn't hold a cell, and
+   everyone queued behind it, for all that time.
+
+   Waiting, for a full or an empty queue, is with -W; those which
+   sleep do so on an event count for the condition they're waiting
+   for, and whoever changes a cell only bumps it, and only then makes
+   the system call, if someone's said they're asleep on it.
+
+   The harness's parent and child are producer 0 and consumer 0, and
+   MPMC_PRODUCERS - 1 and MPMC_CONSUMERS - 1 more start alongside
+   them, in processes or threads to match -T, on the cores after
+   theirs.  Everyone keeps going until consumer 0 has had all of the
+   harness's messages, and then the consumers empty the queue.  With
+   just the two of them the harness sees exactly what it would with
+   mempipe_thr, so the headlines compare directly.  With more,
+   consumer 0 gets other producers' messages, and producer 0's go
+   elsewhere, so we check -v and -V ourselves, on every message, and
+   the headline only counts the harness's own messages; the mpmc log
+   has the lot, along with how long messages spent in the queue. */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "test.h"
+#include "xutil.h"
+#include "futex.h"
+#include "kernels.h"
+#include "verify.h"
+#include "latency_hist.h"
+
+#define CACHE_LINE_SIZE 64
+#define MAX_PRODUCERS 16
+#define MAX_CONSUMERS 16
+
+static int ring_order = 9;
+static int nr_producers = 1;
+static int nr_consumers = 1;
+static int use_extents;
+
+static tunable tunables[] = {
+  { "MPMC_RING_ORDER", &ring_order, 0, 15 },
+  { "MPMC_PRODUCERS", &nr_producers, 1, MAX_PRODUCERS, 1 },
+  { "MPMC_CONSUMERS", &nr_consumers, 1, MAX_CONSUMERS, 1 },
+  { "MPMC_EXTENTS", &use_extents, 0, 1 },
+  { NULL }
+};
+
+struct cell {
+  volatile unsigned long seq;
+  unsigned producer;
+  unsigned size;
+  unsigned long pseq; /* The producer's own count */
+  unsigned long stamp; /* TSC when it was queued */
+  unsigned long extent; /* With MPMC_EXTENTS, or on the free list */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct queue_ctrl {
+  volatile unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  /* Event counts, for sleeping on */
+  volatile unsigned not_empty __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile unsigned not_full __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/* Where one end or the other keeps its queue, which is the same
+   everywhere once init_test has set it up */
+struct queue {
+  struct queue_ctrl *ctrl;
+  char *cells;
+  unsigned long mask;
+  size_t stride;
+};
+
+struct role_stats {
+  volatile unsigned long messages, bytes;
+  volatile unsigned long cas_failures; /* Someone else moved the counter first */
+  volatile unsigned long waits; /* Full, for producers; empty, for consumers */
+  volatile unsigned long first_tsc, last_tsc;
+  volatile int done;
+  /* Consumers', so that we can tell that nothing was lost or
+     duplicated */
+  unsigned long from[MAX_PRODUCERS], seq_sum[MAX_PRODUCERS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct mpmc_ctrl {
+  struct queue_ctrl queue, free;
+  volatile int stop;
+  struct role_stats producers[MAX_PRODUCERS];
+  struct role_stats consumers[MAX_CONSUMERS];
+  struct latency_hist lat[MAX_CONSUMERS];
+};
+
+#define CTRL_PAGES ((sizeof(struct mpmc_ctrl) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct mpmc_state {
+  struct mpmc_ctrl *ctrl;
+  struct queue queue;
+  struct queue free; /* Extents nobody's using */
+  char *extents;
+  size_t extent_size;
+  int kind, budget; /* How to wait, from -W */
+  int check; /* -v or -V, when it's up to us */
+  pid_t helper_pids[MAX_PRODUCERS + MAX_CONSUMERS];
+  pthread_t helper_threads[MAX_PRODUCERS + MAX_CONSUMERS];
+};
+
+/* Each producer's and consumer's own */
+static __thread struct {
+  struct spin_estimate est;
+  struct role_stats *st;
+  int id;
+  unsigned long pseq;
+  struct cell *cur; /* Being written or read... */
+  unsigned long pos; /* ...at this position */
+  unsigned long extent;
+  struct cell msg; /* What the consumer's cell said */
+  char *scratch;
+  test_data *watch; /* The harness's parent watches consumer 0 */
+} me;
+
+static struct cell *
+cell_at(struct queue *q, unsigned long pos)
+{
+  return (struct cell *)(q->cells + (pos & q->mask) * q->stride);
+}
+
+static char *
+extent_at(struct mpmc_state *ms, unsigned long extent)
+{
+  return ms->extents + extent * ms->extent_size;
+}
+
+static int
+producers_done(struct mpmc_state *ms)
+{
+  int i;
+
+  for (i = 0; i < nr_producers; i++)
+    if (!ms->ctrl->producers[i].done)
+      return 0;
+  return 1;
+}
+
+/* After changing a cell, wake anyone asleep on its queue's event
+   count.  The barrier's so that our check for sleepers can't be
+   answered before the cell's visible. */
+static void
+ring(struct mpmc_state *ms, volatile unsigned *ev)
+{
+  if (!wait_sleeps(ms->kind))
+    return;
+  memory_barrier();
+  if (*ev & WAIT_SLEEPING)
+    wake_all_with(ms->kind, ev, ((*ev & ~WAIT_SLEEPING) + 1) & ~WAIT_SLEEPING);
+}
+
+/* Consumer 0 is the harness's child, which exits without saying so
+   if it fails a check, and then nobody tells the helpers to stop */
+static void
+check_consumer(void *arg)
+{
+  test_data *td = arg;
+  struct mpmc_state *ms = td->data;
+  int i;
+
+  if (ms->ctrl->consumers[0].done || !child_exited(td) ||
+      ms->ctrl->consumers[0].done)
+    return;
+  for (i = 1; i < nr_producers + nr_consumers - 1; i++)
+    kill(ms->helper_pids[i], SIGKILL);
+  errx(1, "consumer 0 failed");
+}
+
+/* The cell we want has seq seen, which is the wrong lap.  Wait a
+   round, and then, for the strategies which sleep, say so on ev and
+   look once more, since whoever changed the cell may have looked for
+   sleepers before we'd said. */
+static void
+wait_for_cell(struct mpmc_state *ms, struct waiter *w, volatile unsigned *ev,
+	      struct cell *c, unsigned long seen, int until_done)
+{
+  unsigned cur;
+
+  if (!wait_round(w, (volatile unsigned *)&c->seq, (unsigned)seen))
+    return;
+  cur = *ev;
+  if (!(cur & WAIT_SLEEPING) &&
+      atomic_cmpxchg(ev, cur, cur | WAIT_SLEEPING) != cur)
+    return;
+  if (c->seq != seen || (until_done && producers_done(ms)))
+    return;
+  waiter_sleep(w, ev, cur | WAIT_SLEEPING);
+}
+
+static struct cell *
+enqueue_start(struct mpmc_state *ms, struct queue *q, unsigned long *posp)
+{
+  unsigned long pos = q->ctrl->tail, seq, old;
+  struct waiter w;
+  int waiting = 0;
+  struct cell *c;
+  long dif;
+
+  for (;;) {
+    c = cell_at(q, pos);
+    seq = c->seq;
+    dif = (long)(seq - pos);
+    if (dif == 0) {
+      old = atomic_cmpxchg_long(&q->ctrl->tail, pos, pos + 1);
+      if (old == pos)
+	break;
+      me.st->cas_failures++;
+      pos = old;
+      continue;
+    }
+    if (dif < 0) {
+      if (!waiting) {
+	waiting = 1;
+	me.st->waits++;
+	waiter_start(&w, ms->kind, ms->budget, &me.est);
+	if (me.watch)
+	  waiter_check(&w, check_consumer, me.watch);
+      }
+      wait_for_cell(ms, &w, &q->ctrl->not_full, c, seq, 0);
+    }
+    pos = q->ctrl->tail;
+  }
+  if (waiting)
+    waiter_done(&w);
+  *posp = pos;
+  return c;
+}
+
+static void
+enqueue_finish(struct mpmc_state *ms, struct queue *q, struct cell *c,
+	       unsigned long pos)
+{
+  asm volatile ("" : : : "memory");
+  c->seq = pos + 1;
+  ring(ms, &q->ctrl->not_empty);
+}
+
+/* NULL once the producers have all finished and there's nothing
+   left, if until_done */
+static struct cell *
+dequeue_start(struct mpmc_state *ms, struct queue *q, unsigned long *posp,
+	      int until_done)
+{
+  unsigned long pos = q->ctrl->head, seq, old;
+  struct waiter w;
+  int waiting = 0;
+  struct cell *c;
+  long dif;
+
+  for (;;) {
+    c = cell_at(q, pos);
+    seq = c->seq;
+    dif = (long)(seq - (pos + 1));
+    if (dif == 0) {
+      old = atomic_cmpxchg_long(&q->ctrl->head, pos, pos + 1);
+      if (old == pos)
+	break;
+      me.st->cas_failures++;
+      pos = old;
+      continue;
+    }
+    if (dif < 0) {
+      if (until_done && q->ctrl->tail == pos && producers_done(ms)) {
+	c = NULL;
+	break;
+      }
+      if (!waiting) {
+	waiting = 1;
+	me.st->waits++;
+	waiter_start(&w, ms->kind, ms->budget, &me.est);
+	if (me.watch)
+	  waiter_check(&w, check_consumer, me.watch);
+      }
+      wait_for_cell(ms, &w, &q->ctrl->not_empty, c, seq, until_done);
+    }
+    pos = q->ctrl->head;
+  }
+  if (waiting)
+    waiter_done(&w);
+  *posp = pos;
+  return c;
+}
+
+static void
+dequeue_finish(struct mpmc_state *ms, struct queue *q, struct cell *c,
+	       unsigned long pos)
+{
+  asm volatile ("" : : : "memory");
+  c->seq = pos + q->mask + 1;
+  ring(ms, &q->ctrl->not_full);
+}
+
+/* Somewhere to put the next message, whether it's a cell or an
+   extent */
+static char *
+reserve(struct mpmc_state *ms)
+{
+  struct cell *c;
+  unsigned long pos;
+
+  if (!use_extents) {
+    me.cur = enqueue_start(ms, &ms->queue, &me.pos);
+    return (char *)(me.cur + 1);
+  }
+  c = dequeue_start(ms, &ms->free, &pos, 0);
+  me.extent = c->extent;
+  dequeue_finish(ms, &ms->free, c, pos);
+  return extent_at(ms, me.extent);
+}
+
+static void
+publish(struct mpmc_state *ms, int size)
+{
+  if (use_extents) {
+    me.cur = enqueue_start(ms, &ms->queue, &me.pos);
+    me.cur->extent = me.extent;
+  }
+  me.cur->producer = me.id;
+  me.cur->size = size;
+  me.cur->pseq = me.pseq++;
+  me.cur->stamp = rdtsc();
+  enqueue_finish(ms, &ms->queue, me.cur, me.pos);
+  me.st->messages++;
+  me.st->bytes += size;
+}
+
+/* A message which the harness doesn't write */
+static void
+produce(test_data *td)
+{
+  struct mpmc_state *ms = td->data;
+  struct iovec vec;
+
+  vec.iov_base = reserve(ms);
+  vec.iov_len = td->size;
+  td->kernel->fill(vec.iov_base, (char)me.pseq, td->size);
+  if (ms->check == VERIFY_STAMP)
+    stamp_message(&vec, 1, me.pseq);
+  publish(ms, td->size);
+}
+
+/* The next message, from whoever, or NULL if until_done and there
+   aren't going to be any more.  Its payload stays put until
+   release_message(). */
+static char *
+take_message(struct mpmc_state *ms, int until_done)
+{
+  struct role_stats *st = me.st;
+  unsigned long now;
+  struct cell *c;
+
+  c = dequeue_start(ms, &ms->queue, &me.pos, until_done);
+  if (!c)
+    return NULL;
+  now = rdtsc();
+  if (!st->first_tsc)
+    st->first_tsc = now;
+  me.msg = *c;
+  hist_add(&ms->ctrl->lat[me.id], now - me.msg.stamp);
+  st->messages++;
+  st->bytes += me.msg.size;
+  st->from[me.msg.producer]++;
+  st->seq_sum[me.msg.producer] += me.msg.pseq;
+  if (!use_extents) {
+    me.cur = c;
+    return (char *)(c + 1);
+  }
+  /* The cell can go straight back: the message is in the extent */
+  dequeue_finish(ms, &ms->queue, c, me.pos);
+  return extent_at(ms, me.msg.extent);
+}
+
+/* Check it or copy it out, for a consumer which isn't the harness's
+   or when the harness can't check it */
+static void
+consume(test_data *td, char *p)
+{
+  struct mpmc_state *ms = td->data;
+  struct iovec vec = { .iov_base = p, .iov_len = me.msg.size };
+  struct msg_stamp st;
+  int bad;
+
+  if (ms->check == VERIFY_STAMP)
+    bad = check_message(&vec, 1, me.msg.pseq, &st) != STAMP_OK;
+  else if (ms->check)
+    bad = td->kernel->check(p, (char)me.msg.pseq, me.msg.size);
+  else {
+    td->kernel->copy(me.scratch, p, me.msg.size);
+    bad = 0;
+  }
+  if (bad)
+    errx(1, "producer %u's message %lu is bad", me.msg.producer, me.msg.pseq);
+}
+
+static void
+release_message(struct mpmc_state *ms)
+{
+  struct cell *c;
+  unsigned long pos;
+
+  if (!use_extents) {
+    dequeue_finish(ms, &ms->queue, me.cur, me.pos);
+  } else {
+    c = enqueue_start(ms, &ms->free, &pos);
+    c->extent = me.msg.extent;
+    enqueue_finish(ms, &ms->free, c, pos);
+  }
+  me.st->last_tsc = rdtsc();
+}
+
+static void
+start_role(struct mpmc_state *ms, struct role_stats *st, int id)
+{
+  me.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  me.st = st;
+  me.id = id;
+  me.pseq = 0;
+}
+
+/* Helpers 1 to nr_producers - 1 are producers, and the rest
+   consumers */
+static void
+helper_main(test_data *td, int helper)
+{
+  struct mpmc_state *ms = td->data;
+  struct role_stats *st;
+  char *p;
+  int id;
+
+  if (helper < nr_producers) {
+    id = helper;
+    setaffinity((td->second_core + id) % sysconf(_SC_NPROCESSORS_ONLN));
+    st = &ms->ctrl->producers[id];
+    start_role(ms, st, id);
+    while (!ms->ctrl->stop)
+      produce(td);
+    st->done = 1;
+    wake_all_with(ms->kind, &ms->ctrl->queue.not_empty,
+		  ((ms->ctrl->queue.not_empty & ~WAIT_SLEEPING) + 1) & ~WAIT_SLEEPING);
+    return;
+  }
+  id = helper - nr_producers + 1;
+  setaffinity((td->first_core + id) % sysconf(_SC_NPROCESSORS_ONLN));
+  st = &ms->ctrl->consumers[id];
+  start_role(ms, st, id);
+  me.scratch = xmalloc(td->size);
+  while ((p = take_message(ms, 1))) {
+    consume(td, p);
+    release_message(ms);
+  }
+  free(me.scratch);
+  st->done = 1;
+}
+
+struct helper_args {
+  test_data *td;
+  int helper;
+};
+
+static void *
+helper_thread(void *_args)
+{
+  struct helper_args *args = _args;
+
+  helper_main(args->td, args->helper);
+  free(args);
+  return NULL;
+}
+
+static void
+start_helper(test_data *td, int helper)
+{
+  struct mpmc_state *ms = td->data;
+  struct helper_args *args;
+  pid_t pid;
+  int r;
+
+  if (!td->threaded) {
+    pid = fork();
+    if (pid < 0)
+      err(1, "fork()");
+    if (!pid) {
+      helper_main(td, helper);
+      _exit(0);
+    }
+    ms->helper_pids[helper] = pid;
+    return;
+  }
+  args = xmalloc(sizeof(*args));
+  args->td = td;
+  args->helper = helper;
+  r = pthread_create(&ms->helper_threads[helper], NULL, helper_thread, args);
+  if (r != 0)
+    errx(1, "pthread_create: %s", strerror(r));
+}
+
+static void
+stop_helper(test_data *td, int helper)
+{
+  struct mpmc_state *ms = td->data;
+  int status, r;
+
+  if (td->threaded) {
+    r = pthread_join(ms->helper_threads[helper], NULL);
+    if (r != 0)
+      errx(1, "pthread_join: %s", strerror(r));
+    return;
+  }
+  if (waitpid(ms->helper_pids[helper], &status, 0) < 0)
+    err(1, "waitpid()");
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    errx(1, "helper %d failed", helper);
+}
+
+static void
+init_queue(struct queue *q, struct queue_ctrl *ctrl, char *cells,
+	   unsigned long nr_cells, size_t stride)
+{
+  unsigned long i;
+
+  q->ctrl = ctrl;
+  q->cells = cells;
+  q->mask = nr_cells - 1;
+  q->stride = stride;
+  for (i = 0; i < nr_cells; i++)
+    cell_at(q, i)->seq = i;
+}
+
+static unsigned long
+round_down_pow2(unsigned long n)
+{
+  return n ? 1ul << (63 - __builtin_clzl(n)) : 0;
+}
+
+static void
+init_test(test_data *td)
+{
+  struct mpmc_state *ms = xmalloc(sizeof(*ms));
+  size_t ring_bytes = (size_t)PAGE_SIZE << ring_order;
+  size_t payload = (td->size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  size_t queue_bytes, free_bytes;
+  unsigned long nr_cells, i;
+  struct cell *c;
+  char *p;
+
+  memset(ms, 0, sizeof(*ms));
+  if (!use_extents) {
+    nr_cells = round_down_pow2(ring_bytes / (sizeof(struct cell) + payload));
+    queue_bytes = nr_cells * (sizeof(struct cell) + payload);
+    free_bytes = 0;
+  } else {
+    nr_cells = round_down_pow2(ring_bytes / payload);
+    queue_bytes = free_bytes = nr_cells * sizeof(struct cell);
+  }
+  if (nr_cells < 2)
+    errx(1, "%d byte messages need a bigger MPMC_RING_ORDER", td->size);
+  queue_bytes = (queue_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  free_bytes = (free_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  ms->ctrl = establish_test_segment(td, CTRL_PAGES +
+				    (queue_bytes + free_bytes) / PAGE_SIZE +
+				    (use_extents ? (1 << ring_order) : 0));
+  memset(ms->ctrl, 0, sizeof(*ms->ctrl));
+  p = (char *)ms->ctrl + CTRL_PAGES * PAGE_SIZE;
+  init_queue(&ms->queue, &ms->ctrl->queue, p, nr_cells,
+	     sizeof(struct cell) + (use_extents ? 0 : payload));
+  if (use_extents) {
+    /* Every extent starts out free */
+    init_queue(&ms->free, &ms->ctrl->free, p + queue_bytes, nr_cells,
+	       sizeof(struct cell));
+    for (i = 0; i < nr_cells; i++) {
+      c = cell_at(&ms->free, i);
+      c->extent = i;
+      c->seq = i + 1;
+    }
+    ms->ctrl->free.tail = nr_cells;
+    ms->extents = p + queue_bytes + free_bytes;
+    ms->extent_size = payload;
+  }
+  ms->kind = td->wait_strategy < 0 ? WAIT_FUTEX : td->wait_strategy;
+  ms->budget = td->spin_budget;
+  /* The harness checks messages in the order it sent them, which
+     only holds with one of each */
+  if (nr_producers > 1 || nr_consumers > 1) {
+    ms->check = td->do_verify;
+    td->do_verify = 0;
+  }
+  td->data = ms;
+  get_tsc_freq();
+}
+
+static void
+init_parent(test_data *td)
+{
+  struct mpmc_state *ms = td->data;
+  int i;
+
+  start_role(ms, &ms->ctrl->producers[0], 0);
+  for (i = 1; i < nr_producers + nr_consumers - 1; i++)
+    start_helper(td, i);
+  if (!td->threaded)
+    me.watch = td;
+}
+
+static struct iovec *
+get_write_buffer(test_data *td, int size, int *n_vecs)
+{
+  static __thread struct iovec vec;
+
+  vec.iov_base = reserve(td->data);
+  vec.iov_len = size;
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_write_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  struct mpmc_state *ms = td->data;
+
+  /* The harness would have if it were checking */
+  if (ms->check == VERIFY_STAMP)
+    stamp_message(vecs, n_vecs, me.pseq);
+  publish(ms, vecs[0].iov_len);
+}
+
+static void
+log_mpmc(test_data *td, struct mpmc_state *ms)
+{
+  struct mpmc_ctrl *c = ms->ctrl;
+  double freq = get_tsc_freq();
+  unsigned long messages = 0, bytes = 0, first = ~0ul, last = 0;
+  unsigned long cas = 0, full = 0, empty = 0;
+  static struct latency_hist lat;
+  double secs;
+  int i, b;
+
+  memset(&lat, 0, sizeof(lat));
+  for (i = 0; i < nr_producers; i++) {
+    cas += c->producers[i].cas_failures;
+    full += c->producers[i].waits;
+  }
+  for (i = 0; i < nr_consumers; i++) {
+    struct role_stats *st = &c->consumers[i];
+    messages += st->messages;
+    bytes += st->bytes;
+    cas += st->cas_failures;
+    empty += st->waits;
+    if (st->messages && st->first_tsc < first)
+      first = st->first_tsc;
+    if (st->last_tsc > last)
+      last = st->last_tsc;
+    lat.count += c->lat[i].count;
+    lat.sum += c->lat[i].sum;
+    if (c->lat[i].max > lat.max)
+      lat.max = c->lat[i].max;
+    for (b = 0; b < NR_HIST_BUCKETS; b++)
+      lat.buckets[b] += c->lat[i].buckets[b];
+  }
+  secs = last > first ? (last - first) / freq : 0;
+  logmsg(td, "mpmc",
+	 "%s %d producers %d consumers %d %s cells %lu messages %lu %.0f Mbps "
+	 "%.0f msgs/s queued mean %.2fus p50 %.2fus p99 %.2fus max %.2fus "
+	 "cas failures %lu full waits %lu empty waits %lu %s\n",
+	 td->name, td->size, nr_producers, nr_consumers,
+	 use_extents ? "extents" : "inline", ms->queue.mask + 1, messages,
+	 secs ? bytes * 8 / (secs * 1e6) : 0, secs ? messages / secs : 0,
+	 hist_mean(&lat) / freq * 1e6, hist_percentile(&lat, 0.5) / freq * 1e6,
+	 hist_percentile(&lat, 0.99) / freq * 1e6, lat.max / freq * 1e6,
+	 cas, full, empty, wait_strategy_names[ms->kind]);
+}
+
+/* Everything each producer sent went to exactly one consumer */
+static void
+check_accounts(struct mpmc_state *ms)
+{
+  struct mpmc_ctrl *c = ms->ctrl;
+  unsigned long got, sum, sent;
+  int p, i;
+
+  for (p = 0; p < nr_producers; p++) {
+    got = sum = 0;
+    for (i = 0; i < nr_consumers; i++) {
+      got += c->consumers[i].from[p];
+      sum += c->consumers[i].seq_sum[p];
+    }
+    sent = c->producers[p].messages;
+    if (got != sent || sum != sent * (sent - 1) / 2)
+      errx(1, "producer %d sent %lu messages, but %lu arrived", p, sent, got);
+  }
+}
+
+static void
+finish_parent(test_data *td)
+{
+  struct mpmc_state *ms = td->data;
+  struct mpmc_ctrl *c = ms->ctrl;
+  unsigned n = 0;
+  int i;
+
+  /* If there are other consumers then some of ours went to them, and
+     consumer 0 still wants more */
+  if (nr_consumers > 1)
+    while (!c->stop) {
+      produce(td);
+      if (!(++n & 63))
+	check_consumer(td);
+    }
+  c->producers[0].done = 1;
+  wake_all_with(ms->kind, &c->queue.not_empty,
+		((c->queue.not_empty & ~WAIT_SLEEPING) + 1) & ~WAIT_SLEEPING);
+  /* Consumer 0 sets stop, which the helpers wait for, so only reap
+     them once it's done */
+  while (!c->consumers[0].done) {
+    check_consumer(td);
+    sched_yield();
+  }
+  for (i = 1; i < nr_producers + nr_consumers - 1; i++)
+    stop_helper(td, i);
+  check_accounts(ms);
+  log_mpmc(td, ms);
+}
+
+static void
+init_child(test_data *td)
+{
+  struct mpmc_state *ms = td->data;
+
+  start_role(ms, &ms->ctrl->consumers[0], 0);
+  me.scratch = xmalloc(td->size);
+}
+
+static struct iovec *
+get_read_buffer(test_data *td, int size, int *n_vecs)
+{
+  struct mpmc_state *ms = td->data;
+  static __thread struct iovec vec;
+
+  vec.iov_base = take_message(ms, 0);
+  vec.iov_len = me.msg.size;
+  if (ms->check)
+    consume(td, vec.iov_base);
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_read_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  release_message(td->data);
+}
+
+static void
+finish_child(test_data *td)
+{
+  struct mpmc_state *ms = td->data;
+  char *p;
+
+  /* That's all the harness wanted; stop everyone, and help empty the
+     queue */
+  ms->ctrl->stop = 1;
+  while ((p = take_message(ms, 1))) {
+    consume(td, p);
+    release_message(ms);
+  }
+  free(me.scratch);
+  me.st->done = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_t t = {
+    .name = "mpmc_thr",
+    .is_latency_test = 0,
+    .variable_size = 1,
+    .tunables = tunables,
+    .wait_strategies = WAIT_ALL,
+    .init_test = init_test,
+    .init_parent = init_parent,
+    .finish_parent = finish_parent,
+    .init_child = init_child,
+    .finish_child = finish_child,
+    .get_write_buffer = get_write_buffer,
+    .release_write_buffer = release_write_buffer,
+    .get_read_buffer = get_read_buffer,
+    .release_read_buffer = release_read_buffer
+  };
+  run_test(argc, argv, &t);
+  return 0;
+}
@@ -0,0 +1,506 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* A shared-memory ring which any number of producers can send into
+   at once, and one consumer reads, as a logging or metrics channel
+   would be.  mempipe and shmem_pipe keep their write position in
+   the producer's own memory, so there can only be one of them.
+
+   Here the ring is an array of fixed-size slots, and the write
+   position is a ticket counter in shared memory.  A producer takes
+   the next ticket with a fetch-and-add, which never fails and never
+   has to be retried however many others are at it, and ticket t gets
+   slot t % nr_slots on lap t / nr_slots.  Each slot has a turn word
+   which says whose it is: 2 * lap when it's free for that lap's
+   producer, and 2 * lap + 1 once that producer's filled it in.  The
+   producer waits for its lap, writes the message, and only then
+   bumps the turn, so the consumer, which takes the slots in ticket
+   order, never sees a message which is still being written.  Once
+   it's done with the message it hands the slot on to the next lap.
+
+   Producers which take their tickets close together can finish in
+   either order, so a slow one holds up the consumer behind it, but
+   not the other producers, until the ring's gone all the way round.
+
+   The harness's parent is producer 0, and MPSC_PRODUCERS - 1 more
+   are started alongside it, in processes or threads to match -T and
+   on the cores after the parent's (-b).  They send td->size messages
+   until producer 0 has sent all of its, and the consumer checks
+   their payloads with -v or -V, or copies them out otherwise, but
+   only hands producer 0's to the harness, so the headline is
+   producer 0's share.  The mpsc log has all of it, and how often the
+   producers found the ring full and the consumer found it empty. */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "test.h"
+#include "xutil.h"
+#include "futex.h"
+#include "kernels.h"
+
+#define CACHE_LINE_SIZE 64
+#define MAX_PRODUCERS 64
+#define TURN_MASK (~WAIT_SLEEPING)
+
+static int ring_order = 9;
+static int nr_producers = 1;
+
+static tunable tunables[] = {
+  { "MPSC_RING_ORDER", &ring_order, 0, 15 },
+  { "MPSC_PRODUCERS", &nr_producers, 1, MAX_PRODUCERS, 1 },
+  { NULL }
+};
+
+struct slot_header {
+  volatile unsigned turn;
+  unsigned producer;
+  unsigned size;
+  unsigned long seq; /* The producer's own count, to check ordering */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct producer_stats {
+  volatile unsigned long sent;
+  volatile unsigned long full_waits; /* Our slot wasn't free yet */
+  volatile int done;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct mpsc_ctrl {
+  volatile unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile int go __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile int stop;
+  struct producer_stats producers[MAX_PRODUCERS];
+  /* The consumer's */
+  volatile unsigned long received, bytes, empty_waits;
+  volatile unsigned long first_tsc, last_tsc;
+  volatile int drained;
+};
+
+#define CTRL_PAGES ((sizeof(struct mpsc_ctrl) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct mpsc_state {
+  struct mpsc_ctrl *ctrl;
+  char *ring;
+  unsigned long nr_slots;
+  size_t stride; /* A header and td->size, rounded up to a cache line */
+  int kind, budget; /* How to wait, from -W */
+  pid_t helper_pids[MAX_PRODUCERS];
+  pthread_t helper_threads[MAX_PRODUCERS];
+};
+
+/* Each end's own, and each producer's */
+static __thread struct {
+  struct spin_estimate est;
+  struct slot_header *cur; /* Reserved or being read */
+  unsigned long seq;
+  unsigned long head; /* The consumer's next ticket */
+  unsigned long expect[MAX_PRODUCERS];
+  char *scratch;
+  test_data *watch; /* The harness's parent watches the consumer */
+} me;
+
+static struct slot_header *
+slot_for(struct mpsc_state *ms, unsigned long ticket)
+{
+  return (struct slot_header *)(ms->ring + (ticket % ms->nr_slots) * ms->stride);
+}
+
+static char *
+payload(struct slot_header *h)
+{
+  return (char *)(h + 1);
+}
+
+static unsigned
+turn_for(struct mpsc_state *ms, unsigned long ticket, int ready)
+{
+  return ((ticket / ms->nr_slots) * 2 + ready) & TURN_MASK;
+}
+
+/* The consumer is the harness's child, which exits without saying so
+   if it fails a check, and then nobody frees the others' slots or
+   tells them to stop */
+static void
+check_consumer(void *arg)
+{
+  test_data *td = arg;
+  struct mpsc_state *ms = td->data;
+  int i;
+
+  if (ms->ctrl->drained || !child_exited(td) || ms->ctrl->drained)
+    return;
+  for (i = 1; i < nr_producers; i++)
+    kill(ms->helper_pids[i], SIGKILL);
+  errx(1, "the consumer failed");
+}
+
+/* The turn word goes through other values on its way to want if
+   there are other laps' producers ahead of us */
+static void
+wait_for_turn(struct mpsc_state *ms, struct slot_header *h, unsigned want,
+	      volatile unsigned long *waits)
+{
+  struct waiter w;
+  unsigned cur;
+
+  if ((h->turn & TURN_MASK) == want)
+    return;
+  (*waits)++;
+  waiter_start(&w, ms->kind, ms->budget, &me.est);
+  if (me.watch)
+    waiter_check(&w, check_consumer, me.watch);
+  while ((cur = h->turn & TURN_MASK) != want)
+    wait_while_equal(&w, &h->turn, cur);
+}
+
+static struct slot_header *
+reserve(struct mpsc_state *ms, int producer)
+{
+  unsigned long ticket = atomic_fetch_add_long(&ms->ctrl->tail, 1);
+  struct slot_header *h = slot_for(ms, ticket);
+
+  wait_for_turn(ms, h, turn_for(ms, ticket, 0),
+		&ms->ctrl->producers[producer].full_waits);
+  h->producer = producer;
+  h->seq = me.seq++;
+  return h;
+}
+
+/* Whoever's waiting for this slot might be the consumer or the next
+   lap's producer, or both */
+static void
+publish(struct mpsc_state *ms, struct slot_header *h, int producer)
+{
+  wake_all_with(ms->kind, &h->turn, ((h->turn & TURN_MASK) + 1) & TURN_MASK);
+  ms->ctrl->producers[producer].sent++;
+}
+
+static void
+helper_main(test_data *td, int producer)
+{
+  struct mpsc_state *ms = td->data;
+  struct producer_stats *st = &ms->ctrl->producers[producer];
+  struct slot_header *h;
+
+  setaffinity((td->second_core + producer) % sysconf(_SC_NPROCESSORS_ONLN));
+  me.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  me.seq = 0;
+  while (!ms->ctrl->go)
+    sched_yield();
+  while (!ms->ctrl->stop) {
+    h = reserve(ms, producer);
+    h->size = td->size;
+    td->kernel->fill(payload(h), (char)h->seq, td->size);
+    publish(ms, h, producer);
+  }
+  st->done = 1;
+}
+
+struct helper_args {
+  test_data *td;
+  int producer;
+};
+
+static void *
+helper_thread(void *_args)
+{
+  struct helper_args *args = _args;
+
+  helper_main(args->td, args->producer);
+  free(args);
+  return NULL;
+}
+
+static void
+start_helper(test_data *td, int producer)
+{
+  struct mpsc_state *ms = td->data;
+  struct helper_args *args;
+  pid_t pid;
+  int r;
+
+  if (!td->threaded) {
+    pid = fork();
+    if (pid < 0)
+      err(1, "fork()");
+    if (!pid) {
+      helper_main(td, producer);
+      _exit(0);
+    }
+    ms->helper_pids[producer] = pid;
+    return;
+  }
+  args = xmalloc(sizeof(*args));
+  args->td = td;
+  args->producer = producer;
+  r = pthread_create(&ms->helper_threads[producer], NULL, helper_thread, args);
+  if (r != 0)
+    errx(1, "pthread_create: %s", strerror(r));
+}
+
+static void
+stop_helper(test_data *td, int producer)
+{
+  struct mpsc_state *ms = td->data;
+  int status, r;
+
+  if (td->threaded) {
+    r = pthread_join(ms->helper_threads[producer], NULL);
+    if (r != 0)
+      errx(1, "pthread_join: %s", strerror(r));
+    return;
+  }
+  if (waitpid(ms->helper_pids[producer], &status, 0) < 0)
+    err(1, "waitpid()");
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    errx(1, "producer %d failed", producer);
+}
+
+static void
+init_test(test_data *td)
+{
+  struct mpsc_state *ms = xmalloc(sizeof(*ms));
+  size_t ring_bytes = (size_t)PAGE_SIZE << ring_order;
+
+  memset(ms, 0, sizeof(*ms));
+  ms->stride = sizeof(struct slot_header) +
+    ((td->size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+  ms->nr_slots = ring_bytes / ms->stride;
+  if (ms->nr_slots < 2)
+    errx(1, "%d byte messages need a bigger MPSC_RING_ORDER", td->size);
+  ms->ctrl = establish_test_segment(td, CTRL_PAGES + (1 << ring_order));
+  ms->ring = (char *)ms->ctrl + CTRL_PAGES * PAGE_SIZE;
+  memset(ms->ctrl, 0, sizeof(*ms->ctrl));
+  /* Slot i starts out free for ticket i, on lap 0 */
+  memset(ms->ring, 0, ring_bytes);
+  ms->kind = td->wait_strategy < 0 ? WAIT_FUTEX : td->wait_strategy;
+  ms->budget = td->spin_budget;
+  td->data = ms;
+  get_tsc_freq();
+}
+
+static void
+init_parent(test_data *td)
+{
+  int i;
+
+  me.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  me.seq = 0;
+  for (i = 1; i < nr_producers; i++)
+    start_helper(td, i);
+  if (!td->threaded)
+    me.watch = td;
+}
+
+static struct iovec *
+get_write_buffer(test_data *td, int size, int *n_vecs)
+{
+  struct mpsc_state *ms = td->data;
+  static __thread struct iovec vec;
+
+  if (!ms->ctrl->go)
+    ms->ctrl->go = 1;
+  me.cur = reserve(ms, 0);
+  me.cur->size = size;
+  vec.iov_base = payload(me.cur);
+  vec.iov_len = size;
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_write_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  publish(td->data, me.cur, 0);
+}
+
+static void
+finish_parent(test_data *td)
+{
+  struct mpsc_state *ms = td->data;
+  struct mpsc_ctrl *c = ms->ctrl;
+  double freq = get_tsc_freq();
+  unsigned long min = ~0ul, max = 0, full = 0;
+  double secs;
+  int i;
+
+  c->stop = 1;
+  /* The consumer only says it's drained once the others have all
+     stopped, so wait for that first: if it fails a check instead,
+     they can be stuck waiting for it to free their slots */
+  while (!c->drained) {
+    check_consumer(td);
+    sched_yield();
+  }
+  for (i = 1; i < nr_producers; i++)
+    stop_helper(td, i);
+
+  for (i = 0; i < nr_producers; i++) {
+    unsigned long sent = c->producers[i].sent;
+    if (sent < min)
+      min = sent;
+    if (sent > max)
+      max = sent;
+    full += c->producers[i].full_waits;
+  }
+  secs = (c->last_tsc - c->first_tsc) / freq;
+  logmsg(td, "mpsc",
+	 "%s %d producers %d slots %lu messages %lu %.0f Mbps %.0f msgs/s "
+	 "per producer min %lu max %lu full waits %lu empty waits %lu %s\n",
+	 td->name, td->size, nr_producers, ms->nr_slots, c->received,
+	 secs > 0 ? c->bytes * 8 / (secs * 1e6) : 0,
+	 secs > 0 ? c->received / secs : 0, min, max, full, c->empty_waits,
+	 wait_strategy_names[ms->kind]);
+}
+
+static void
+init_child(test_data *td)
+{
+  me.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  me.head = 0;
+  memset(me.expect, 0, sizeof(me.expect));
+  me.scratch = xmalloc(td->size);
+}
+
+/* Wait for the next message, whoever it's from */
+static struct slot_header *
+next_message(struct mpsc_state *ms)
+{
+  struct slot_header *h = slot_for(ms, me.head);
+
+  wait_for_turn(ms, h, turn_for(ms, me.head, 1), &ms->ctrl->empty_waits);
+  if (h->producer >= nr_producers || h->seq != me.expect[h->producer])
+    errx(1, "message %lu from producer %u was number %lu, not %lu", me.head,
+	 h->producer, h->seq,
+	 h->producer < nr_producers ? me.expect[h->producer] : 0);
+  me.expect[h->producer]++;
+  if (!ms->ctrl->first_tsc)
+    ms->ctrl->first_tsc = rdtsc();
+  return h;
+}
+
+static void
+consumed(struct mpsc_state *ms, struct slot_header *h)
+{
+  struct mpsc_ctrl *c = ms->ctrl;
+
+  c->received++;
+  c->bytes += h->size;
+  c->last_tsc = rdtsc();
+  wake_all_with(ms->kind, &h->turn, turn_for(ms, me.head + ms->nr_slots, 0));
+  me.head++;
+}
+
+/* Someone else's: the harness never sees it, so we check it or copy
+   it out ourselves */
+static void
+take_helper_message(test_data *td, struct slot_header *h)
+{
+  if (td->do_verify && td->kernel->check(payload(h), (char)h->seq, h->size))
+    errx(1, "producer %u's message %lu is bad", h->producer, h->seq);
+  else if (!td->do_verify)
+    td->kernel->copy(me.scratch, payload(h), h->size);
+  consumed(td->data, h);
+}
+
+static struct iovec *
+get_read_buffer(test_data *td, int size, int *n_vecs)
+{
+  struct mpsc_state *ms = td->data;
+  static __thread struct iovec vec;
+  struct slot_header *h;
+
+  while ((h = next_message(ms))->producer != 0)
+    take_helper_message(td, h);
+  me.cur = h;
+  vec.iov_base = payload(h);
+  vec.iov_len = h->size;
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_read_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  consumed(td->data, me.cur);
+}
+
+static void
+finish_child(test_data *td)
+{
+  struct mpsc_state *ms = td->data;
+  struct mpsc_ctrl *c = ms->ctrl;
+  struct slot_header *h;
+  int i;
+
+  /* Keep the others going until they've all stopped, without
+     sleeping on a slot which nobody might ever fill... */
+  for (i = 1; i < nr_producers; i++) {
+    while (!c->producers[i].done) {
+      h = slot_for(ms, me.head);
+      if ((h->turn & TURN_MASK) == turn_for(ms, me.head, 1))
+	take_helper_message(td, next_message(ms));
+      else
+	sched_yield();
+    }
+  }
+  /* ...and then whatever tickets they'd taken by then */
+  while (me.head != c->tail)
+    take_helper_message(td, next_message(ms));
+  free(me.scratch);
+  c->drained = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_t t = {
+    .name = "mpsc_thr",
+    .is_latency_test = 0,
+    .variable_size = 1,
+    .tunables = tunables,
+    .wait_strategies = WAIT_ALL,
+    .init_test = init_test,
+    .init_parent = init_parent,
+    .finish_parent = finish_parent,
+    .init_child = init_child,
+    .finish_child = finish_child,
+    .get_write_buffer = get_write_buffer,
+    .release_write_buffer = release_write_buffer,
+    .get_read_buffer = get_read_buffer,
+    .release_read_buffer = release_read_buffer
+  };
+  run_test(argc, argv, &t);
+  return 0;
+}
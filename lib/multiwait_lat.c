@@ -0,0 +1,373 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* One consumer asleep on many rings at once, as a daemon which fans
+   in from lots of clients would be.  Each ring is reduced to the
+   word a mempipe consumer would sleep on, a sequence number which the
+   producer bumps when it publishes.  Every ping the parent publishes
+   on one of MULTIWAIT_RINGS rings, picked so as to move around all
+   of them, and the child has to wake up, find it, and say so.  There
+   are two ways for it to wait:
+
+   futex_waitv(), on every ring's word at once.  The kernel looks at
+   all of them before it sleeps and queues us on all of them, so it
+   costs O(rings) a sleep, and it only takes FUTEX_WAITV_MAX (128).
+
+   A doorbell, for any number.  A publisher sets the ring's bit in a
+   ready bitmap, then the bitmap word's bit in a summary word, and
+   then rings the one futex word the consumer sleeps on, so the
+   consumer only ever looks at the words with something in them.
+
+   MULTIWAIT_DOORBELL=1 uses the doorbell even where futex_waitv()
+   would do, so the two can be compared.  Either way, the publisher
+   only makes the system call if the consumer has said it's going to
+   sleep, as mempipe does.  The multiwait log has the one-way latency,
+   from just before the publish to the consumer knowing which ring it
+   was, and how much CPU the consumer used per wake. */
+
+#include <sys/syscall.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "xutil.h"
+#include "futex.h"
+#include "latency_hist.h"
+
+#define CACHE_LINE_SIZE 64
+#define MAX_RINGS 4096 /* 64 bitmap words, so one summary word */
+#define BITS_PER_WORD 64
+
+#ifndef FUTEX_WAITV_MAX
+#define FUTEX_WAITV_MAX 128
+#endif
+
+static int nr_rings = 1;
+static int force_doorbell;
+
+static tunable tunables[] = {
+  { "MULTIWAIT_RINGS", &nr_rings, 1, MAX_RINGS, 1 },
+  { "MULTIWAIT_DOORBELL", &force_doorbell, 0, 1 },
+  { NULL }
+};
+
+struct ring {
+  volatile unsigned seq;
+  volatile unsigned long stamp; /* The TSC just before the last publish */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct multiwait_state {
+  /* Set by the consumer just before it sleeps */
+  volatile unsigned sleeping __attribute__((aligned(CACHE_LINE_SIZE)));
+  /* The doorbell: the word the consumer sleeps on and the bitmaps */
+  volatile unsigned doorbell __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile unsigned long summary __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile unsigned long ready[MAX_RINGS / BITS_PER_WORD] __attribute__((aligned(CACHE_LINE_SIZE)));
+  /* The way back, which isn't what we're measuring */
+  volatile unsigned ack __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile int child_done;
+  /* The consumer's */
+  int use_doorbell;
+  struct latency_hist lat;
+  unsigned long sleeps, cpu_ns;
+  struct ring rings[MAX_RINGS];
+};
+
+#define MULTIWAIT_PAGES ((sizeof(struct multiwait_state) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/* The consumer's own state: what it's seen of each ring, for
+   futex_waitv() as much as anything, and the rings it's taken out of
+   the bitmap but not yet dealt with. */
+static __thread struct {
+#ifdef HAVE_FUTEX_WAITV
+  struct futex_waitv waiters[FUTEX_WAITV_MAX];
+#endif
+  unsigned long pending[MAX_RINGS / BITS_PER_WORD];
+  unsigned long pending_summary;
+  unsigned next, stride; /* The producer's: which ring to publish on next */
+  struct timespec cpu_start;
+} mw;
+
+static unsigned long
+thread_cpu_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static int
+have_futex_waitv(void)
+{
+#ifdef HAVE_FUTEX_WAITV
+  static unsigned word;
+  struct futex_waitv fw;
+
+  /* A value it isn't, so that it comes straight back */
+  memset(&fw, 0, sizeof(fw));
+  fw.uaddr = (uintptr_t)&word;
+  fw.val = 1;
+  fw.flags = FUTEX_32;
+  return futex_waitv(&fw, 1) < 0 && errno == EAGAIN;
+#else
+  return 0;
+#endif
+}
+
+static void
+init_test(test_data *td)
+{
+  struct multiwait_state *ms = establish_test_segment(td, MULTIWAIT_PAGES);
+
+  memset(ms, 0, sizeof(*ms));
+  ms->use_doorbell = force_doorbell || nr_rings > FUTEX_WAITV_MAX ||
+    !have_futex_waitv();
+  td->data = ms;
+  get_tsc_freq();
+}
+
+static unsigned
+gcd(unsigned a, unsigned b)
+{
+  while (b) {
+    unsigned t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static void
+init_parent(test_data *td)
+{
+  mw.next = 0;
+  /* Go round all of the rings but not in order, which takes a stride
+     with no factor in common with how many there are */
+  mw.stride = 257;
+  while (gcd(mw.stride, nr_rings) != 1)
+    mw.stride++;
+}
+
+static void
+init_child(test_data *td)
+{
+  struct multiwait_state *ms = td->data;
+#ifdef HAVE_FUTEX_WAITV
+  int i;
+
+  for (i = 0; i < nr_rings && i < FUTEX_WAITV_MAX; i++) {
+    memset(&mw.waiters[i], 0, sizeof(mw.waiters[i]));
+    mw.waiters[i].uaddr = (uintptr_t)&ms->rings[i].seq;
+    mw.waiters[i].val = 0; /* Not seq, which the parent may have bumped already */
+    mw.waiters[i].flags = FUTEX_32;
+  }
+#endif
+  memset(mw.pending, 0, sizeof(mw.pending));
+  mw.pending_summary = 0;
+  ms->cpu_ns = thread_cpu_ns();
+}
+
+static void
+publish(struct multiwait_state *ms, int i)
+{
+  struct ring *r = &ms->rings[i];
+
+  r->stamp = rdtsc();
+  r->seq++;
+  if (ms->use_doorbell) {
+    /* Locked, and so full barriers, which the check of doorbell
+       after them needs */
+    atomic_or_long(&ms->ready[i / BITS_PER_WORD], 1ul << (i % BITS_PER_WORD));
+    atomic_or_long(&ms->summary, 1ul << (i / BITS_PER_WORD));
+    if (ms->doorbell && atomic_xchg(&ms->doorbell, 0))
+      futex_wake(&ms->doorbell);
+  } else {
+    memory_barrier();
+    if (ms->sleeping)
+      futex_wake(&r->seq);
+  }
+}
+
+/* A ring which the doorbell says is ready, or -1 */
+static int
+take_ready(struct multiwait_state *ms)
+{
+  unsigned long s, bits;
+  int j;
+
+  if (!mw.pending_summary) {
+    /* Summary first, so that a bit which turns up meanwhile puts its
+       summary bit back for next time */
+    s = ms->summary ? atomic_xchg_long(&ms->summary, 0) : 0;
+    while (s) {
+      j = __builtin_ctzl(s);
+      s &= s - 1;
+      bits = atomic_xchg_long(&ms->ready[j], 0);
+      if (bits) {
+	mw.pending[j] |= bits;
+	mw.pending_summary |= 1ul << j;
+      }
+    }
+    if (!mw.pending_summary)
+      return -1;
+  }
+  j = __builtin_ctzl(mw.pending_summary);
+  bits = mw.pending[j];
+  mw.pending[j] = bits & (bits - 1);
+  if (!mw.pending[j])
+    mw.pending_summary &= ~(1ul << j);
+  return j * BITS_PER_WORD + __builtin_ctzl(bits);
+}
+
+static int
+wait_doorbell(struct multiwait_state *ms)
+{
+  int i;
+
+  while ((i = take_ready(ms)) < 0) {
+    atomic_xchg(&ms->doorbell, 1);
+    if ((i = take_ready(ms)) >= 0) {
+      ms->doorbell = 0;
+      break;
+    }
+    ms->sleeps++;
+    futex_wait_while_equal(&ms->doorbell, 1);
+  }
+  return i;
+}
+
+#ifdef HAVE_FUTEX_WAITV
+static int
+wait_futex_waitv(struct multiwait_state *ms)
+{
+  int i, r;
+
+  for (;;) {
+    ms->sleeping = 1;
+    memory_barrier();
+    ms->sleeps++;
+    r = futex_waitv(mw.waiters, nr_rings);
+    ms->sleeping = 0;
+    if (r < 0 && errno != EAGAIN && errno != EINTR)
+      err(1, "futex_waitv");
+    /* It says which one woke us, but not which one was already
+       different when it looked */
+    if (r >= 0 && ms->rings[r].seq != mw.waiters[r].val) {
+      i = r;
+      break;
+    }
+    for (i = 0; i < nr_rings; i++)
+      if (ms->rings[i].seq != mw.waiters[i].val)
+	break;
+    if (i < nr_rings)
+      break;
+  }
+  mw.waiters[i].val = ms->rings[i].seq;
+  return i;
+}
+#else
+static int
+wait_futex_waitv(struct multiwait_state *ms)
+{
+  abort();
+}
+#endif
+
+static void
+parent_ping(test_data *td)
+{
+  struct multiwait_state *ms = td->data;
+  struct waiter w;
+  unsigned ack = ms->ack;
+
+  publish(ms, mw.next);
+  mw.next = (mw.next + mw.stride) % nr_rings;
+  waiter_start(&w, WAIT_FUTEX, 0, NULL);
+  wait_while_equal(&w, &ms->ack, ack);
+}
+
+static void
+child_ping(test_data *td)
+{
+  struct multiwait_state *ms = td->data;
+  int i;
+
+  i = ms->use_doorbell ? wait_doorbell(ms) : wait_futex_waitv(ms);
+  hist_add(&ms->lat, rdtsc() - ms->rings[i].stamp);
+  wake_with(WAIT_FUTEX, &ms->ack, (ms->ack + 1) & ~WAIT_SLEEPING);
+}
+
+static void
+finish_child(test_data *td)
+{
+  struct multiwait_state *ms = td->data;
+
+  ms->cpu_ns = thread_cpu_ns() - ms->cpu_ns;
+  ms->child_done = 1;
+}
+
+static void
+finish_parent(test_data *td)
+{
+  struct multiwait_state *ms = td->data;
+  double freq = get_tsc_freq();
+
+  while (!ms->child_done)
+    sched_yield();
+  logmsg(td, "multiwait",
+	 "%s rings %d %s wakes %lu sleeps %lu one-way mean %.2fus p50 %.2fus "
+	 "p99 %.2fus max %.2fus consumer cpu %.2fus/wake\n",
+	 td->name, nr_rings, ms->use_doorbell ? "doorbell" : "futex_waitv",
+	 ms->lat.count, ms->sleeps, hist_mean(&ms->lat) / freq * 1e6,
+	 hist_percentile(&ms->lat, 0.5) / freq * 1e6,
+	 hist_percentile(&ms->lat, 0.99) / freq * 1e6, ms->lat.max / freq * 1e6,
+	 ms->lat.count ? ms->cpu_ns / (ms->lat.count * 1e3) : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_t t = {
+    .name = "multiwait_lat",
+    .is_latency_test = 1,
+    .tunables = tunables,
+    .init_test = init_test,
+    .init_parent = init_parent,
+    .init_child = init_child,
+    .finish_parent = finish_parent,
+    .finish_child = finish_child,
+    .parent_ping = parent_ping,
+    .child_ping = child_ping
+  };
+  run_test(argc, argv, &t);
+  return 0;
+}
@@ -0,0 +1,394 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* How long it takes one process to wake another up, and how many
+   times a second it can do it, for each of the ways Linux gives us of
+   doing so.  Which one this is is picked when it's compiled:
+
+     NOTIFY_FUTEX     bump a word and futex_wake() it
+     NOTIFY_WAITV     the same, but the waiter sleeps in futex_waitv()
+     NOTIFY_EVENTFD   write() a count to an eventfd
+     NOTIFY_PIPE      write() a byte per notification down a pipe
+     NOTIFY_SIGNAL    sigqueue() a real-time signal, aimed at the thread
+     NOTIFY_SEM       sem_post() an unnamed semaphore in shared memory
+     NOTIFY_CONDVAR   bump a count and signal a process-shared condvar
+
+   Each ping sends NOTIFY_BURST notifications one way and waits for
+   one back.  With a burst of 1 that's a round trip of two wakes,
+   like futex_lat but through the harness, so -a, -b, -c, -t, -T, -g
+   and -p all work.  Each notification is stamped with the TSC just
+   before it's sent, and the waiter looks at the clock as soon as it's
+   running again, so the notify log has the one-way latency of each
+   direction as well.  With a bigger burst the waiter wakes up to
+   several at once, and notifications per second in the log is the
+   most the mechanism can deliver. */
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "xutil.h"
+#include "futex.h"
+#include "latency_hist.h"
+
+#if defined(NOTIFY_FUTEX)
+#define NOTIFY_NAME "notify_futex_lat"
+#elif defined(NOTIFY_WAITV)
+#define NOTIFY_NAME "notify_waitv_lat"
+#elif defined(NOTIFY_EVENTFD)
+#define NOTIFY_NAME "notify_eventfd_lat"
+#elif defined(NOTIFY_PIPE)
+#define NOTIFY_NAME "notify_pipe_lat"
+#elif defined(NOTIFY_SIGNAL)
+#define NOTIFY_NAME "notify_signal_lat"
+#elif defined(NOTIFY_SEM)
+#define NOTIFY_NAME "notify_sem_lat"
+#elif defined(NOTIFY_CONDVAR)
+#define NOTIFY_NAME "notify_condvar_lat"
+#else
+#error "Build with one of the NOTIFY_ mechanisms"
+#endif
+
+#define CACHE_LINE_SIZE 64
+#define NOTIFY_BURST_MAX 4096
+
+static int burst = 1;
+
+static tunable tunables[] = {
+  { "NOTIFY_BURST", &burst, 1, NOTIFY_BURST_MAX, 1 },
+  { NULL }
+};
+
+/* One direction.  Both ends' stats are in shared memory, since only
+   the parent logs. */
+struct channel {
+  /* Written by whoever posts */
+  volatile unsigned posted; /* The count, for futex, waitv and condvar */
+  volatile unsigned long stamp; /* The TSC just before the latest post */
+  /* And by whoever waits */
+  struct {
+    unsigned seen; /* Of posted */
+    volatile int ready; /* Can be signalled */
+    pid_t tgid, tid;
+    unsigned long notes;
+    struct latency_hist lat; /* One per wake */
+  } __attribute__((aligned(CACHE_LINE_SIZE))) w;
+#if defined(NOTIFY_EVENTFD) || defined(NOTIFY_PIPE)
+  int fds[2];
+#elif defined(NOTIFY_SEM)
+  sem_t sem;
+#elif defined(NOTIFY_CONDVAR)
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* ch[0] is parent to child, ch[1] child to parent */
+struct notify_state {
+  struct channel ch[2];
+  unsigned long start_tsc;
+};
+
+#define NOTIFY_PAGES ((sizeof(struct notify_state) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+static void
+setup_channel(struct channel *ch)
+{
+#if defined(NOTIFY_EVENTFD)
+  ch->fds[0] = ch->fds[1] = eventfd(0, 0);
+  if (ch->fds[0] < 0)
+    err(1, "eventfd");
+#elif defined(NOTIFY_PIPE)
+  if (pipe(ch->fds) < 0)
+    err(1, "pipe");
+#elif defined(NOTIFY_SEM)
+  if (sem_init(&ch->sem, 1, 0) < 0)
+    err(1, "sem_init");
+#elif defined(NOTIFY_CONDVAR)
+  pthread_mutexattr_t ma;
+  pthread_condattr_t ca;
+
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&ch->mutex, &ma);
+  pthread_mutexattr_destroy(&ma);
+  pthread_condattr_init(&ca);
+  pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&ch->cond, &ca);
+  pthread_condattr_destroy(&ca);
+#endif
+}
+
+static void
+post(struct channel *ch, int n)
+{
+#if defined(NOTIFY_FUTEX) || defined(NOTIFY_WAITV)
+  ch->stamp = rdtsc();
+  ch->posted += n;
+  futex_wake(&ch->posted);
+#elif defined(NOTIFY_EVENTFD)
+  uint64_t v = n;
+
+  ch->stamp = rdtsc();
+  xwrite(ch->fds[1], &v, sizeof(v));
+#elif defined(NOTIFY_PIPE)
+  static const char bytes[NOTIFY_BURST_MAX];
+
+  ch->stamp = rdtsc();
+  xwrite(ch->fds[1], bytes, n);
+#elif defined(NOTIFY_SIGNAL)
+  siginfo_t si;
+  int i;
+
+  memset(&si, 0, sizeof(si));
+  si.si_signo = SIGRTMIN;
+  si.si_code = SI_QUEUE;
+  si.si_pid = getpid();
+  si.si_uid = getuid();
+  for (i = 0; i < n; i++) {
+    ch->stamp = rdtsc();
+    /* sigqueue(), but to the waiting thread rather than to whichever
+       thread of its process happens to pick it up */
+    while (syscall(SYS_rt_tgsigqueueinfo, ch->w.tgid, ch->w.tid, SIGRTMIN, &si) < 0) {
+      if (errno != EAGAIN)
+	err(1, "rt_tgsigqueueinfo");
+      sched_yield(); /* The queue's full */
+    }
+  }
+#elif defined(NOTIFY_SEM)
+  int i;
+
+  ch->stamp = rdtsc();
+  for (i = 0; i < n; i++)
+    if (sem_post(&ch->sem) < 0)
+      err(1, "sem_post");
+#elif defined(NOTIFY_CONDVAR)
+  pthread_mutex_lock(&ch->mutex);
+  ch->stamp = rdtsc();
+  ch->posted += n;
+  pthread_cond_signal(&ch->cond);
+  pthread_mutex_unlock(&ch->mutex);
+#endif
+}
+
+/* Sleep until there's at least one notification, and take all of
+   them; how many was that? */
+static int
+wait_for(struct channel *ch)
+{
+  unsigned long took;
+  int got;
+#if defined(NOTIFY_FUTEX)
+  unsigned cur;
+
+  while ((cur = ch->posted) == ch->w.seen)
+    futex_wait_while_equal(&ch->posted, cur);
+  got = cur - ch->w.seen;
+  ch->w.seen = cur;
+#elif defined(NOTIFY_WAITV) && defined(HAVE_FUTEX_WAITV)
+  struct futex_waitv fw;
+  unsigned cur;
+
+  memset(&fw, 0, sizeof(fw));
+  fw.uaddr = (uintptr_t)&ch->posted;
+  fw.flags = FUTEX_32;
+  while ((cur = ch->posted) == ch->w.seen) {
+    fw.val = cur;
+    if (futex_waitv(&fw, 1) < 0 && errno != EAGAIN)
+      err(1, "futex_waitv");
+  }
+  got = cur - ch->w.seen;
+  ch->w.seen = cur;
+#elif defined(NOTIFY_WAITV)
+  /* init_test won't have let us get this far */
+  abort();
+#elif defined(NOTIFY_EVENTFD)
+  uint64_t v;
+
+  xread(ch->fds[0], &v, sizeof(v));
+  got = v;
+#elif defined(NOTIFY_PIPE)
+  char bytes[NOTIFY_BURST_MAX];
+
+  while ((got = read(ch->fds[0], bytes, sizeof(bytes))) < 0 && errno == EINTR)
+    ;
+  if (got <= 0)
+    err(1, "read");
+#elif defined(NOTIFY_SIGNAL)
+  static const struct timespec now;
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGRTMIN);
+  while (sigwaitinfo(&set, NULL) < 0)
+    if (errno != EINTR)
+      err(1, "sigwaitinfo");
+  for (got = 1; sigtimedwait(&set, NULL, &now) >= 0; got++)
+    ;
+#elif defined(NOTIFY_SEM)
+  while (sem_wait(&ch->sem) < 0)
+    if (errno != EINTR)
+      err(1, "sem_wait");
+  for (got = 1; sem_trywait(&ch->sem) == 0; got++)
+    ;
+#elif defined(NOTIFY_CONDVAR)
+  pthread_mutex_lock(&ch->mutex);
+  while (ch->posted == ch->w.seen)
+    pthread_cond_wait(&ch->cond, &ch->mutex);
+  got = ch->posted - ch->w.seen;
+  ch->w.seen = ch->posted;
+  pthread_mutex_unlock(&ch->mutex);
+#endif
+  took = rdtsc() - ch->stamp;
+  ch->w.notes += got;
+  hist_add(&ch->w.lat, took);
+  return got;
+}
+
+/* We're about to wait on ch */
+static void
+start_waiting(struct channel *ch)
+{
+#if defined(NOTIFY_SIGNAL)
+  sigset_t set;
+
+  /* So that it's left queued for sigwaitinfo() */
+  sigemptyset(&set);
+  sigaddset(&set, SIGRTMIN);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+  ch->w.tgid = getpid();
+  ch->w.tid = syscall(SYS_gettid);
+  ch->w.ready = 1;
+}
+
+static void
+init_test(test_data *td)
+{
+  struct notify_state *ns;
+
+#if defined(NOTIFY_WAITV) && !defined(HAVE_FUTEX_WAITV)
+  errx(1, "built against headers without futex_waitv(), which came in Linux 5.16");
+#endif
+  ns = establish_test_segment(td, NOTIFY_PAGES);
+  memset(ns, 0, sizeof(*ns));
+  setup_channel(&ns->ch[0]);
+  setup_channel(&ns->ch[1]);
+  td->data = ns;
+  /* Once, before we fork, for the log */
+  get_tsc_freq();
+}
+
+static void
+init_parent(test_data *td)
+{
+  struct notify_state *ns = td->data;
+
+  start_waiting(&ns->ch[1]);
+  /* Don't signal the child before it can take it */
+  while (!ns->ch[0].w.ready)
+    sched_yield();
+  ns->start_tsc = rdtsc();
+}
+
+static void
+init_child(test_data *td)
+{
+  struct notify_state *ns = td->data;
+
+  start_waiting(&ns->ch[0]);
+}
+
+static void
+parent_ping(test_data *td)
+{
+  struct notify_state *ns = td->data;
+
+  post(&ns->ch[0], burst);
+  wait_for(&ns->ch[1]);
+}
+
+static void
+child_ping(test_data *td)
+{
+  struct notify_state *ns = td->data;
+  int got;
+
+  for (got = 0; got < burst; )
+    got += wait_for(&ns->ch[0]);
+  post(&ns->ch[1], 1);
+}
+
+static void
+finish_parent(test_data *td)
+{
+  struct notify_state *ns = td->data;
+  double freq = get_tsc_freq();
+  double secs = (rdtsc() - ns->start_tsc) / freq;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    const struct channel *ch = &ns->ch[i];
+    if (!ch->w.lat.count)
+      continue;
+    logmsg(td, "notify",
+	   "%s %s burst %d notes %lu %.0f/s wakes %lu one-way mean %.2fus "
+	   "p50 %.2fus p99 %.2fus max %.2fus\n",
+	   td->name, i ? "child-to-parent" : "parent-to-child", burst,
+	   ch->w.notes, ch->w.notes / secs, ch->w.lat.count,
+	   hist_mean(&ch->w.lat) / freq * 1e6,
+	   hist_percentile(&ch->w.lat, 0.5) / freq * 1e6,
+	   hist_percentile(&ch->w.lat, 0.99) / freq * 1e6,
+	   ch->w.lat.max / freq * 1e6);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_t t = {
+    .name = NOTIFY_NAME,
+    .is_latency_test = 1,
+    .tunables = tunables,
+    .init_test = init_test,
+    .init_parent = init_parent,
+    .init_child = init_child,
+    .finish_parent = finish_parent,
+    .parent_ping = parent_ping,
+    .child_ping = child_ping
+  };
+  run_test(argc, argv, &t);
+  return 0;
+}
@@ -86,6 +86,7 @@ main(int argc, char *argv[])
 {
   test_t t = { .name = "pipe_lat", 
 	       .is_latency_test = 1,
+	       .data_size = sizeof(pipe_state),
 	       .init_test = init_test,
 	       .init_parent = local_init,
 	       .init_child = local_init,
@@ -73,6 +73,7 @@ get_read_buf(test_data *td, int len, int* n_vecs)
 {
   pipe_state *ps = (pipe_state *)td->data;
   xread(ps->fds[0], ps->buffer.iov_base, len);
+  ps->buffer.iov_len = len;
   *n_vecs = 1;
   return &ps->buffer;
 }
@@ -93,7 +94,7 @@ static void child_fin(test_data *td) {
 
 static struct iovec* get_write_buf(test_data *td, int len, int* n_vecs) {
   pipe_state *ps = (pipe_state *)td->data;
-  assert(len == td->size);
+  ps->buffer.iov_len = len;
   *n_vecs = 1;
   return &ps->buffer;
 }
@@ -117,6 +118,8 @@ main(int argc, char *argv[])
   test_t t = { 
     .name = "pipe_thr",
     .is_latency_test = 0,
+    .data_size = sizeof(pipe_state),
+    .variable_size = 1,
     .init_test = init_test,
     .init_parent = init_local,
     .finish_parent = parent_fin,
@@ -0,0 +1,397 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* A channel which only carries the latest value, for state snapshots
+   where the reader doesn't care about anything it's missed.  There's
+   no ring and no flow control: the writer overwrites a slot under a
+   sequence lock, making the slot's sequence number odd before it
+   starts and even again once it's done, and the reader copies the
+   slot out without telling the writer anything, and has another go
+   if the sequence number was odd or changed while it was copying.
+
+   Each read waits for a newer value than the last one, but not for
+   every value in between, so a writer which is faster than the
+   reader just has most of its values go unread.  -g sets how fast
+   the writer goes, as it would for any other producer.  Once the
+   harness's writes are done, the writer carries on at the same pace
+   until the reader's had all of its reads.
+
+   A big value takes a while to write, and a reader which keeps
+   running into the writer could retry forever, so with SEQLOCK_SLOTS
+   more than 1 the writer goes round that many slots, each with its
+   own sequence number, and then says which one's the latest.  A
+   reader of the latest slot only has to retry if the writer's come
+   all the way round to it again.
+
+   The reader hands the harness its private copy, and since that
+   usually isn't the message the harness thinks is next, we check -v
+   and -V ourselves, against the version the slot said it was, which
+   is what would catch a torn read.  The seqlock log has how long
+   writes and reads took, retries included, how old values were by
+   the time they'd been read, and how many reads had to retry. */
+
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "xutil.h"
+#include "futex.h"
+#include "kernels.h"
+#include "verify.h"
+#include "workload.h"
+#include "latency_hist.h"
+
+#define CACHE_LINE_SIZE 64
+#define MAX_SLOTS 16
+
+static int nr_slots = 1;
+
+static tunable tunables[] = {
+  { "SEQLOCK_SLOTS", &nr_slots, 1, MAX_SLOTS, 1 },
+  { NULL }
+};
+
+struct slot_header {
+  volatile unsigned long seq; /* Odd while it's being written */
+  unsigned long version; /* Which write this is */
+  unsigned long stamp; /* TSC when it was written */
+  unsigned size;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct seqlock_ctrl {
+  /* How many writes are done; the latest is version latest - 1 */
+  volatile unsigned long latest __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile unsigned ev; /* Event count, for readers to sleep on */
+  /* The reader's */
+  unsigned long reads __attribute__((aligned(CACHE_LINE_SIZE)));
+  unsigned long retries, retried_reads, waits;
+  volatile int reader_done;
+  struct latency_hist read_lat, age;
+};
+
+#define CTRL_PAGES ((sizeof(struct seqlock_ctrl) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct seqlock_state {
+  struct seqlock_ctrl *ctrl;
+  char *slots;
+  size_t stride;
+  int kind, budget; /* How to wait, from -W */
+  int check; /* -v or -V, which we do rather than the harness */
+};
+
+/* Each end's own */
+static __thread struct {
+  struct spin_estimate est;
+  struct slot_header *cur; /* Being written */
+  unsigned long writes;
+  unsigned long start_tsc;
+  struct latency_hist write_lat;
+  unsigned long last; /* Latest version read, plus one */
+  char *snapshot;
+} me;
+
+static struct slot_header *
+slot(struct seqlock_state *ss, unsigned long version)
+{
+  return (struct slot_header *)(ss->slots + (version % nr_slots) * ss->stride);
+}
+
+static char *
+payload(struct slot_header *h)
+{
+  return (char *)(h + 1);
+}
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+init_test(test_data *td)
+{
+  struct seqlock_state *ss = xmalloc(sizeof(*ss));
+  size_t bytes;
+
+  memset(ss, 0, sizeof(*ss));
+  ss->stride = sizeof(struct slot_header) +
+    ((td->size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+  bytes = (nr_slots * ss->stride + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  ss->ctrl = establish_test_segment(td, CTRL_PAGES + bytes / PAGE_SIZE);
+  ss->slots = (char *)ss->ctrl + CTRL_PAGES * PAGE_SIZE;
+  memset(ss->ctrl, 0, CTRL_PAGES * PAGE_SIZE + bytes);
+  ss->kind = td->wait_strategy < 0 ? WAIT_FUTEX : td->wait_strategy;
+  ss->budget = td->spin_budget;
+  /* The harness would check the reader's messages against the ones
+     it thinks it sent in order */
+  ss->check = td->do_verify;
+  td->do_verify = 0;
+  td->data = ss;
+  get_tsc_freq();
+}
+
+static void
+init_parent(test_data *td)
+{
+  me.writes = 0;
+  memset(&me.write_lat, 0, sizeof(me.write_lat));
+}
+
+static struct iovec *
+get_write_buffer(test_data *td, int size, int *n_vecs)
+{
+  struct seqlock_state *ss = td->data;
+  static __thread struct iovec vec;
+  struct slot_header *h = slot(ss, me.writes);
+
+  me.start_tsc = rdtsc();
+  h->seq++;
+  /* x86 doesn't reorder stores with other stores, so all that's
+     needed is for the compiler not to */
+  asm volatile ("" : : : "memory");
+  me.cur = h;
+  vec.iov_base = payload(h);
+  vec.iov_len = size;
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_write_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+  struct seqlock_state *ss = td->data;
+  struct seqlock_ctrl *c = ss->ctrl;
+  struct slot_header *h = me.cur;
+
+  if (ss->check == VERIFY_STAMP)
+    stamp_message(vecs, n_vecs, me.writes);
+  h->version = me.writes;
+  h->size = vecs[0].iov_len;
+  h->stamp = rdtsc();
+  asm volatile ("" : : : "memory");
+  h->seq++;
+  c->latest = ++me.writes;
+  hist_add(&me.write_lat, rdtsc() - me.start_tsc);
+  if (!wait_sleeps(ss->kind))
+    return;
+  memory_barrier();
+  if (c->ev & WAIT_SLEEPING)
+    wake_all_with(ss->kind, &c->ev, ((c->ev & ~WAIT_SLEEPING) + 1) & ~WAIT_SLEEPING);
+}
+
+/* One of the writes which the harness didn't ask for */
+static void
+write_one(test_data *td)
+{
+  struct iovec *vecs;
+  int n_vecs;
+
+  vecs = get_write_buffer(td, td->size, &n_vecs);
+  td->kernel->fill(vecs[0].iov_base, (char)me.writes, td->size);
+  release_write_buffer(td, vecs, n_vecs);
+}
+
+static void
+finish_parent(test_data *td)
+{
+  struct seqlock_state *ss = td->data;
+  struct seqlock_ctrl *c = ss->ctrl;
+  double freq = get_tsc_freq();
+  struct workload_cursor wc;
+  uint64_t next = now_ns();
+  unsigned long harness_writes = me.writes;
+  unsigned n = 0;
+
+  workload_start(&wc, td->num + 1);
+  while (!c->reader_done) {
+    if (td->workload && td->workload->gaps) {
+      next += workload_gap(td->workload, &wc);
+      while (now_ns() < next && !c->reader_done)
+	;
+    }
+    write_one(td);
+    /* A reader which finds a torn read exits without saying it's
+       done */
+    if (!(++n & 63) && child_exited(td) && !c->reader_done)
+      errx(1, "the reader failed");
+  }
+
+  logmsg(td, "seqlock",
+	 "%s %d slots %d writes %lu (%lu extra) reads %lu retried %.2f%% "
+	 "retries %lu waits %lu write mean %.2fus p50 %.2fus p99 %.2fus "
+	 "read mean %.2fus p50 %.2fus p99 %.2fus age p50 %.2fus p99 %.2fus %s\n",
+	 td->name, td->size, nr_slots, me.writes, me.writes - harness_writes,
+	 c->reads, c->reads ? 100.0 * c->retried_reads / c->reads : 0,
+	 c->retries, c->waits,
+	 hist_mean(&me.write_lat) / freq * 1e6,
+	 hist_percentile(&me.write_lat, 0.5) / freq * 1e6,
+	 hist_percentile(&me.write_lat, 0.99) / freq * 1e6,
+	 hist_mean(&c->read_lat) / freq * 1e6,
+	 hist_percentile(&c->read_lat, 0.5) / freq * 1e6,
+	 hist_percentile(&c->read_lat, 0.99) / freq * 1e6,
+	 hist_percentile(&c->age, 0.5) / freq * 1e6,
+	 hist_percentile(&c->age, 0.99) / freq * 1e6,
+	 wait_strategy_names[ss->kind]);
+}
+
+static void
+init_child(test_data *td)
+{
+  me.est = (struct spin_estimate)SPIN_ESTIMATE_INIT;
+  me.last = 0;
+  me.snapshot = xmalloc(td->size);
+}
+
+/* Wait for a write newer than the last one we read */
+static unsigned long
+wait_for_news(struct seqlock_state *ss)
+{
+  struct seqlock_ctrl *c = ss->ctrl;
+  unsigned long latest = c->latest;
+  struct waiter w;
+  unsigned cur;
+
+  if (latest > me.last)
+    return latest;
+  c->waits++;
+  waiter_start(&w, ss->kind, ss->budget, &me.est);
+  while ((latest = c->latest) <= me.last) {
+    if (!wait_round(&w, (volatile unsigned *)&c->latest, (unsigned)latest))
+      continue;
+    /* Say we're asleep, then look again in case the write came
+       before we'd said so */
+    cur = c->ev;
+    if (!(cur & WAIT_SLEEPING) &&
+	atomic_cmpxchg(&c->ev, cur, cur | WAIT_SLEEPING) != cur)
+      continue;
+    if (c->latest == latest)
+      futex_wait_while_equal(&c->ev, cur | WAIT_SLEEPING);
+  }
+  waiter_done(&w);
+  return latest;
+}
+
+static struct iovec *
+get_read_buffer(test_data *td, int size, int *n_vecs)
+{
+  struct seqlock_state *ss = td->data;
+  struct seqlock_ctrl *c = ss->ctrl;
+  static __thread struct iovec vec;
+  unsigned long latest, seq, version, stamp, start;
+  struct slot_header *h;
+  struct msg_stamp st;
+  int tries = 0, bad;
+  unsigned len;
+
+  latest = wait_for_news(ss);
+  start = rdtsc();
+  for (;;) {
+    h = slot(ss, latest - 1);
+    seq = h->seq;
+    if (!(seq & 1)) {
+      /* Loads aren't reordered with other loads either */
+      asm volatile ("" : : : "memory");
+      version = h->version;
+      stamp = h->stamp;
+      len = h->size;
+      if (len > td->size)
+	len = td->size;
+      td->kernel->copy(me.snapshot, payload(h), len);
+      asm volatile ("" : : : "memory");
+      if (h->seq == seq)
+	break;
+    }
+    /* Torn: whatever's latest now */
+    tries++;
+    cpu_relax();
+    latest = c->latest;
+  }
+  hist_add(&c->read_lat, rdtsc() - start);
+  hist_add(&c->age, rdtsc() - stamp);
+  c->reads++;
+  c->retries += tries;
+  if (tries)
+    c->retried_reads++;
+  me.last = version + 1;
+
+  vec.iov_base = me.snapshot;
+  vec.iov_len = len;
+  if (ss->check == VERIFY_STAMP)
+    bad = check_message(&vec, 1, version, &st) != STAMP_OK;
+  else
+    bad = ss->check && td->kernel->check(me.snapshot, (char)version, len);
+  if (bad)
+    errx(1, "read a torn copy of version %lu", version);
+  *n_vecs = 1;
+  return &vec;
+}
+
+static void
+release_read_buffer(test_data *td, struct iovec *vecs, int n_vecs)
+{
+}
+
+static void
+finish_child(test_data *td)
+{
+  struct seqlock_state *ss = td->data;
+
+  free(me.snapshot);
+  ss->ctrl->reader_done = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_t t = {
+    .name = "seqlock_thr",
+    .is_latency_test = 0,
+    .variable_size = 1,
+    .tunables = tunables,
+    .wait_strategies = WAIT_ALL,
+    .init_test = init_test,
+    .init_parent = init_parent,
+    .finish_parent = finish_parent,
+    .init_child = init_child,
+    .finish_child = finish_child,
+    .get_write_buffer = get_write_buffer,
+    .release_write_buffer = release_write_buffer,
+    .get_read_buffer = get_read_buffer,
+    .release_read_buffer = release_read_buffer
+  };
+  run_test(argc, argv, &t);
+  return 0;
+}
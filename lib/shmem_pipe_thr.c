@@ -23,8 +23,23 @@
 
 #define PAGE_ORDER 12
 #define CACHE_LINE_SIZE 64
-static unsigned ring_order = 9;
+static int ring_order = 9;
 #define ring_size (1ul << (PAGE_ORDER + ring_order))
+/* The receiver batches up returned extents until they cover this
+   fraction of the ring. */
+static int return_divisor = 8;
+/* The receiver prefetches the extent this many ahead of the one it's
+   reading, if it's already been told about it. */
+static int prefetch_distance;
+static int prefetch_write;
+
+static tunable tunables[] = {
+	{ "SHMEM_RING_ORDER", &ring_order, 0, 15 },
+	{ "SHMEM_RETURN_DIVISOR", &return_divisor, 1, 4096, 1 },
+	{ "SHMEM_PREFETCH", &prefetch_distance, 0, 64 },
+	{ "SHMEM_PREFETCH_WRITE", &prefetch_write, 0, 1 },
+	{ NULL }
+};
 
 #define EXTENT_BUFFER_SIZE 4096
 
@@ -444,7 +459,7 @@ init_test(test_data *td)
 {
 	struct shmem_pipe *sp = calloc(sizeof(*sp), 1);
 	int pip[2];
-	sp->ring = establish_shm_segment(1 << ring_order, td->numa_node);
+	sp->ring = establish_test_segment(td, 1 << ring_order);
 	if (pipe(pip) < 0)
 		err(1, "pipe()");
 	sp->child_to_parent_read = pip[0];
@@ -473,14 +488,18 @@ init_child(test_data *td)
         sp->incoming_bytes = 0; // METADATA bytes in the incoming extent buffer
 	sp->incoming_bytes_consumed = 0; // of which, already consumed
 
-	close(sp->child_to_parent_read);
-	close(sp->parent_to_child_write);
+	/* Threads share a file table, so the other end still needs these */
+	if (!td->threaded) {
+		close(sp->child_to_parent_read);
+		close(sp->parent_to_child_write);
+	}
 }
 
-static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
-
-  struct shmem_pipe *sp = td->data;
-
+/* Wait until we've been told about at least one extent.  Zero at the
+   end of the test. */
+static int
+wait_for_extents(struct shmem_pipe *sp)
+{
   while(sp->incoming_bytes_consumed - sp->incoming_bytes < sizeof(struct extent)) {
 
     int k = read(sp->parent_to_child_read,
@@ -489,7 +508,6 @@ static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
     if (k == 0) {
       close(sp->child_to_parent_write);
       close(sp->parent_to_child_read);
-      *n_vecs = 0;
       return 0;
     }
     if (k < 0)
@@ -497,6 +515,17 @@ static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
     sp->incoming_bytes += k;
 
   }
+  return 1;
+}
+
+static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
+
+  struct shmem_pipe *sp = td->data;
+
+  if (!wait_for_extents(sp)) {
+    *n_vecs = 0;
+    return 0;
+  }
   
   struct extent *inc = (struct extent*)(sp->incoming + sp->incoming_bytes_consumed);
   assert(inc->base <= ring_size);
@@ -505,19 +534,24 @@ static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
   sp->iov.iov_base = sp->ring + inc->base;
   sp->iov.iov_len = inc->size;
   *n_vecs = 1;
-  return &sp->iov;
 
-}
-
-static void release_read_buffer(test_data* td, struct iovec* vecs, int nvecs) {
+  if (prefetch_distance &&
+      sp->incoming_bytes_consumed + (prefetch_distance + 1) * sizeof(struct extent) <= sp->incoming_bytes) {
+    struct extent *ahead = inc + prefetch_distance;
+    prefetch_range(sp->ring + ahead->base, ahead->size, prefetch_write);
+  }
 
-  struct shmem_pipe *sp = td->data;
+  return &sp->iov;
 
-  assert(nvecs == 1 && vecs == &sp->iov);
+}
 
+/* Done with the oldest incoming extent, which is at vec */
+static void
+consume_extent(struct shmem_pipe *sp, const struct iovec *vec)
+{
   struct extent *inc = (struct extent*)(sp->incoming + sp->incoming_bytes_consumed);
-  assert(sp->ring + inc->base == vecs[0].iov_base);
-  assert(inc->size == vecs[0].iov_len);
+  assert(sp->ring + inc->base == vec->iov_base);
+  assert(inc->size == vec->iov_len);
 
   // Dismiss this incoming extent
   sp->incoming_bytes_consumed += sizeof(struct extent);
@@ -539,17 +573,73 @@ static void release_read_buffer(test_data* td, struct iovec* vecs, int nvecs) {
     sp->nr_outgoing_extents++;
   }
   sp->outgoing_extent_bytes += inc->size;
+}
 
-  // Send the queued extents, if the queue is big enough
-
-  if (sp->outgoing_extent_bytes > ring_size / 8) {
+/* Send the queued extents, if the queue is big enough */
+static void
+return_extents(struct shmem_pipe *sp)
+{
+  if (sp->outgoing_extent_bytes > ring_size / return_divisor) {
     xwrite(sp->child_to_parent_write,
 	   sp->outgoing_extents,
 	   sp->nr_outgoing_extents * sizeof(struct extent));
     sp->nr_outgoing_extents = 0;
     sp->outgoing_extent_bytes = 0;
   }
+}
+
+static void release_read_buffer(test_data* td, struct iovec* vecs, int nvecs) {
+
+  struct shmem_pipe *sp = td->data;
+
+  assert(nvecs == 1 && vecs == &sp->iov);
+
+  consume_extent(sp, vecs);
+  return_extents(sp);
+
+}
+
+/* Batches: take every extent we've already been told about, up to
+   nr, and hand them all back before deciding whether to return them */
+static int
+get_read_batch(test_data *td, struct batch_msg *msgs, int nr)
+{
+  struct shmem_pipe *sp = td->data;
+  struct extent *inc;
+  int k;
+
+  if (!wait_for_extents(sp))
+    return 0;
+  inc = (struct extent*)(sp->incoming + sp->incoming_bytes_consumed);
+  for (k = 0; k < nr && sp->incoming_bytes_consumed + (k + 1) * sizeof(struct extent) <= sp->incoming_bytes; k++) {
+    msgs[k].size = inc[k].size;
+    msgs[k].n_vecs = 1;
+    msgs[k].vecs[0].iov_base = sp->ring + inc[k].base;
+    msgs[k].vecs[0].iov_len = inc[k].size;
+  }
+  return k;
+}
+
+static void
+release_read_batch(test_data *td, struct batch_msg *msgs, int nr)
+{
+  struct shmem_pipe *sp = td->data;
+  int k;
 
+  for (k = 0; k < nr; k++)
+    consume_extent(sp, msgs[k].vecs);
+  return_extents(sp);
+}
+
+static void
+child_finish(test_data *td)
+{
+  struct shmem_pipe *sp = td->data;
+
+  /* Exiting would do this for us, but a child thread has to close
+     its end explicitly before the parent sees EOF. */
+  close(sp->child_to_parent_write);
+  close(sp->parent_to_child_read);
 }
 
 static void
@@ -608,6 +698,42 @@ release_write_buffer(test_data* td, struct iovec* vecs, int nvecs)
   assert(sp->nr_alloc_nodes <= 3);
 }
 
+/* Allocate as many of the batch as we can, waiting only for the first,
+   and then tell the receiver about all of them in one write */
+static int
+get_write_batch(test_data *td, struct batch_msg *msgs, int nr)
+{
+  struct shmem_pipe *sp = td->data;
+  unsigned offset;
+  int k;
+
+  for (k = 0; k < nr; k++) {
+    while ((offset = alloc_shared_space(sp, msgs[k].size)) == ALLOC_FAILED) {
+      if (k)
+	return k;
+      wait_for_returned_buffers(sp);
+    }
+    msgs[k].n_vecs = 1;
+    msgs[k].vecs[0].iov_base = sp->ring + offset;
+    msgs[k].vecs[0].iov_len = msgs[k].size;
+  }
+  return k;
+}
+
+static void
+release_write_batch(test_data *td, struct batch_msg *msgs, int nr)
+{
+  struct shmem_pipe *sp = td->data;
+  struct extent ext[MAX_BATCH];
+  int k;
+
+  for (k = 0; k < nr; k++) {
+    ext[k].base = msgs[k].vecs[0].iov_base - sp->ring;
+    ext[k].size = msgs[k].size;
+  }
+  xwrite(sp->parent_to_child_write, ext, nr * sizeof(ext[0]));
+}
+
 static void
 parent_finish(test_data* td)
 {
@@ -628,13 +754,25 @@ parent_finish(test_data* td)
   close(sp->child_to_parent_read);
 }
 
+/* The receiver can sit on up to ring_size / return_divisor bytes
+   before giving them back, and the rest of the free space might be
+   split in two around the end of the ring, so this is the most we
+   can be sure of getting in one piece. */
+static int
+max_fragment(test_data *td)
+{
+  return (ring_size - ring_size / return_divisor) / 2;
+}
+
 static void
 init_parent(test_data *td)
 {
   struct shmem_pipe *sp = td->data;
 
-  close(sp->child_to_parent_write);
-  close(sp->parent_to_child_read);
+  if (!td->threaded) {
+    close(sp->child_to_parent_write);
+    close(sp->parent_to_child_read);
+  }
 }
 
 int
@@ -643,24 +781,24 @@ main(int argc, char *argv[])
 	test_t t = 
 	  { .name = "shmem_pipe_thr",
 	    .is_latency_test = 0,
+	    .data_size = sizeof(struct shmem_pipe),
+	    .variable_size = 1,
+	    .max_fragment = max_fragment,
+	    .tunables = tunables,
 	    .init_test = init_test,
 	    .init_parent = init_parent,
 	    .finish_parent = parent_finish,
 	    .init_child = init_child,
+	    .finish_child = child_finish,
 	    .get_write_buffer = get_write_buffer,
 	    .release_write_buffer = release_write_buffer,
 	    .get_read_buffer = get_read_buffer,
-	    .release_read_buffer = release_read_buffer
+	    .release_read_buffer = release_read_buffer,
+	    .get_write_batch = get_write_batch,
+	    .release_write_batch = release_write_batch,
+	    .get_read_batch = get_read_batch,
+	    .release_read_batch = release_read_batch
 	  };
-	char *_ring_order = getenv("SHMEM_RING_ORDER");
-	if (_ring_order) {
-		int as_int;
-		if (sscanf(_ring_order, "%d", &as_int) != 1)
-			err(1, "SHMEM_RING_ORDER must be an integer");
-		if (as_int < 0 || as_int > 15)
-			errx(1, "SHMEM_RING_ORDER must be between 0 and 15");
-		ring_order = as_int;
-	}
 	run_test(argc, argv, &t);
 	return 0;
 }
@@ -148,6 +148,7 @@ main(int argc, char *argv[])
     .name = "tcp_lat", 
 #endif
     .is_latency_test = 1,
+    .data_size = sizeof(struct tcp_state),
     .init_test = init_test, 
     .init_parent = init_parent,
     .init_child = child_init,
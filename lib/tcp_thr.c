@@ -119,6 +119,7 @@ get_read_buf(test_data *td, int len, int* n_vecs)
 {
   struct tcp_state *ps = (struct tcp_state *)td->data;
   xread(ps->fd, ps->buffer.iov_base, len);
+  ps->buffer.iov_len = len;
   *n_vecs = 1;
   return &ps->buffer;
 }
@@ -132,7 +133,7 @@ release_read_buf(test_data *td, struct iovec* vecs, int n_vecs) {
 
 static struct iovec* get_write_buf(test_data *td, int len, int* n_vecs) {
   struct tcp_state *ps = (struct tcp_state *)td->data;
-  assert(len == td->size);
+  ps->buffer.iov_len = len;
   *n_vecs = 1;
   return &ps->buffer;
 }
@@ -190,6 +191,8 @@ main(int argc, char *argv[])
     "thr"
     ,
     .is_latency_test = 0,
+    .data_size = sizeof(struct tcp_state),
+    .variable_size = 1,
     .init_test = init_test,
     .init_parent = init_parent,
     .finish_parent = parent_finish,
@@ -34,15 +34,312 @@
 #include <sys/time.h>
 #include <err.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#ifdef Linux
+#include <sys/prctl.h>
+#endif
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include "test.h"
 #include "xutil.h"
+#include "kernels.h"
+#include "verify.h"
+#include "workload.h"
+#include "futex.h"
+
+/* What each parallel pair reports back to run_test. */
+struct pair_result {
+  struct timeval start;
+  struct timeval stop;
+  uint64_t bytes;
+};
+
+/* Shared between all of the processes of a -p run, so that the pairs
+   can start together and we can aggregate their results at the end. */
+struct parallel_state {
+  pthread_barrier_t start_barrier;
+  int nr_pairs;
+  struct pair_result results[];
+};
+
+static struct parallel_state *parallel_state;
+
+/* Set while the tuner is running trials, which it logs itself */
+static int tuning;
+
+static struct sweep *sweep;
+static void log_sweep_point(test_t *test, test_data *td, unsigned long delta, double result);
+
+/* Also after a failed run, whose survivors were killed part of the
+   way through it */
+static void
+init_start_barrier(int nr_pairs)
+{
+  pthread_barrierattr_t attr;
+
+  if (pthread_barrierattr_init(&attr) ||
+      pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+      pthread_barrier_init(&parallel_state->start_barrier, &attr, nr_pairs))
+    errx(1, "initialising start barrier");
+  pthread_barrierattr_destroy(&attr);
+}
+
+static void
+init_parallel_state(int nr_pairs)
+{
+  size_t sz = sizeof(struct parallel_state) + nr_pairs * sizeof(struct pair_result);
+
+  parallel_state = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (parallel_state == MAP_FAILED)
+    err(1, "mapping parallel state");
+  parallel_state->nr_pairs = nr_pairs;
+  init_start_barrier(nr_pairs);
+}
+
+static double
+tv_to_secs(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec * 1e-6;
+}
+
+/* Whether to move this run's messages about with non-temporal
+   accesses rather than the kernel's usual ones. */
+static int
+streaming(const test_data *td)
+{
+  return td->nt_mode && td->size >= td->nt_threshold;
+}
+
+static void
+copy_payload(const test_data *td, void *dst, const void *src, size_t len)
+{
+  if (streaming(td))
+    stream_copy(dst, src, len, td->nt_mode);
+  else
+    td->kernel->copy(dst, src, len);
+}
+
+static const char *
+describe_cache_mode(char *buf, size_t len, int mode, size_t pool)
+{
+  static const char *modes[] = { "hot", "cold", "pool" };
+
+  if (mode == CACHE_POOL)
+    snprintf(buf, len, "pool:%zu", pool);
+  else
+    snprintf(buf, len, "%s", modes[mode]);
+  return buf;
+}
+
+/* -W, as it was given */
+static const char *
+describe_wait(const test_data *td)
+{
+  static __thread char buf[32];
+
+  if (td->wait_strategy < 0)
+    return "default";
+  if (td->wait_strategy == WAIT_FUTEX && td->spin_budget)
+    snprintf(buf, sizeof(buf), "futex:%d", td->spin_budget);
+  else
+    snprintf(buf, sizeof(buf), "%s", wait_strategy_names[td->wait_strategy]);
+  return buf;
+}
+
+/* How the payload gets moved, as one word for the logs */
+static const char *
+describe_copies(const test_data *td)
+{
+  static __thread char buf[PATH_MAX];
+  static const char *modes[] = { "", "nt-store", "nt-load", "nt-both" };
+  char src[32], dst[32];
+  int n;
+
+  n = snprintf(buf, sizeof(buf), "%s", td->kernel->name);
+  if (td->nt_mode)
+    n += snprintf(buf + n, sizeof(buf) - n, ",%s:%d", modes[td->nt_mode],
+		  td->nt_threshold);
+  if (td->source_cache != CACHE_HOT || td->dest_cache != CACHE_HOT)
+    n += snprintf(buf + n, sizeof(buf) - n, ",src-%s,dst-%s",
+		  describe_cache_mode(src, sizeof(src), td->source_cache, td->source_pool),
+		  describe_cache_mode(dst, sizeof(dst), td->dest_cache, td->dest_pool));
+  if (td->workload && td->workload->sizes)
+    n += snprintf(buf + n, sizeof(buf) - n, ",sizes-%s", td->workload->sizes->spec);
+  if (td->workload && td->workload->gaps)
+    n += snprintf(buf + n, sizeof(buf) - n, ",gaps-%s", td->workload->gaps->spec);
+  if (td->fragment && td->size > td->fragment)
+    n += snprintf(buf + n, sizeof(buf) - n, ",frag:%d", td->fragment);
+  if (td->batch > 1)
+    n += snprintf(buf + n, sizeof(buf) - n, ",batch:%d", td->batch);
+  if (td->wait_strategy >= 0)
+    snprintf(buf + n, sizeof(buf) - n, ",wait:%s", describe_wait(td));
+  return buf;
+}
+
+/* The smallest message the harness can cope with */
+static int
+min_message_size(const test_data *td)
+{
+  return td->do_verify == VERIFY_STAMP ? sizeof(struct msg_stamp) : 1;
+}
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* With -g, a latency test sleeps for each gap before it pings, rather
+   than pinging back to back, so that by the time the ping goes the
+   other end has had the chance to go to sleep and its CPU to drop
+   into a deep idle state.  Every round trip is then the first message
+   after an idle spell, which is what a sparse stream of requests
+   sees. */
+static void
+idle_for(long ns)
+{
+  struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+static void
+log_idle_latencies(test_data *td, const unsigned long *cycles)
+{
+  double freq = get_tsc_freq();
+  double *us = xmalloc(td->count * sizeof(double));
+  double sum = 0;
+  size_t i;
+
+  for (i = 0; i < td->count; i++) {
+    us[i] = cycles[i] / freq * 1e6;
+    sum += us[i];
+  }
+  qsort(us, td->count, sizeof(us[0]), cmp_double);
+#define PERCENTILE(p) us[(td->count - 1) * (p) / 100]
+  logmsg(td, "idle",
+	 "%s %d %zd round trip after idle mean %.2fus p50 %.2fus p90 %.2fus "
+	 "p99 %.2fus max %.2fus %s\n",
+	 td->name, td->size, td->count, sum / td->count, PERCENTILE(50),
+	 PERCENTILE(90), PERCENTILE(99), us[td->count - 1], describe_copies(td));
+#undef PERCENTILE
+  free(us);
+}
+
+/* The buffers which the producer copies from and the consumer copies
+   into.  Usually there's just one, but in CACHE_POOL mode there are
+   enough to cover the pool, and we use them in turn so that each one
+   has long since left the cache by the time we get back to it. */
+struct private_pool {
+  char *base;
+  size_t nr_bufs;
+};
+
+static void
+alloc_private_pool(struct private_pool *pp, const test_data *td, int mode,
+		   size_t pool, int prefill)
+{
+  size_t i;
+
+  pp->nr_bufs = 1;
+  if (mode == CACHE_POOL) {
+    pp->nr_bufs = pool / td->size;
+    /* Iteration i sends byte i, so if the number of buffers is a
+       multiple of 256 then each buffer always holds the same byte and
+       the source can be filled in once, up front. */
+    if (prefill)
+      pp->nr_bufs = pp->nr_bufs ? (pp->nr_bufs + 255) & ~255ul : 256;
+    else if (pp->nr_bufs == 0)
+      pp->nr_bufs = 1;
+  }
+  pp->base = xmalloc(pp->nr_bufs * td->size);
+  /* Fault it all in now, rather than on the clock */
+  for (i = 0; i < pp->nr_bufs; i++)
+    memset(pp->base + i * td->size, prefill ? (char)i : 0, td->size);
+}
+
+static char *
+private_pool_buf(const struct private_pool *pp, const test_data *td, int i)
+{
+  return pp->base + (i % pp->nr_bufs) * td->size;
+}
+
+/* Summarise a -p run: total throughput, how fairly it was shared
+   between the pairs (min/max and Jain's index), and how long all of
+   the pairs were actually running at the same time. */
+static void
+log_parallel_results(test_data *pair_td)
+{
+  test_data agg_td = *pair_td;
+  test_data *td = &agg_td;
+  struct pair_result *res = parallel_state->results;
+  int n = parallel_state->nr_pairs;
+  double first_start, last_start, first_stop, last_stop;
+  double total, total_sq, min, max, overlap, jain;
+  int i;
+
+  first_start = last_start = tv_to_secs(&res[0].start);
+  first_stop = last_stop = tv_to_secs(&res[0].stop);
+  total = total_sq = 0;
+  min = max = -1;
+  for (i = 0; i < n; i++) {
+    double start = tv_to_secs(&res[i].start);
+    double stop = tv_to_secs(&res[i].stop);
+    double mbps = res[i].bytes * 8 / ((stop - start) * 1e6);
+
+    if (start < first_start)
+      first_start = start;
+    if (start > last_start)
+      last_start = start;
+    if (stop < first_stop)
+      first_stop = stop;
+    if (stop > last_stop)
+      last_stop = stop;
+    if (min < 0 || mbps < min)
+      min = mbps;
+    if (mbps > max)
+      max = mbps;
+    total += mbps;
+    total_sq += mbps * mbps;
+  }
+  overlap = first_stop - last_start;
+  if (overlap < 0)
+    overlap = 0;
+  /* Perfectly fair, if nobody got anywhere */
+  jain = total_sq ? (total * total) / (n * total_sq) : 1.0;
+
+  td->num = 0;
+  logmsg(td,
+	 "aggregate",
+	 "%s %d %d %d %d %d %d %d %d %" PRId64 " %d pairs %.0f Mbps min %.0f max %.0f jain %.4f overlap %fs span %fs %s\n",
+	 td->name, td->first_core, td->second_core,
+	 td->numa_node,
+	 td->size,
+	 td->produce_method, td->write_in_place, td->read_in_place, td->do_verify, td->count,
+	 n, total, min, max, jain,
+	 overlap, last_stop - first_start, describe_copies(td));
+}
 
 static void
 wait_for_children_to_finish(void)
@@ -70,6 +367,111 @@ wait_for_children_to_finish(void)
   }
 }
 
+int
+child_exited(test_data *td)
+{
+  siginfo_t info;
+
+  if (td->threaded || td->child_pid <= 0)
+    return 0;
+  /* Leaving it for wait_for_children_to_finish() to reap */
+  info.si_pid = 0;
+  if (waitid(P_PID, td->child_pid, &info, WEXITED|WNOHANG|WNOWAIT) < 0)
+    err(1, "waitid()");
+  return info.si_pid != 0;
+}
+
+/* The -p instances each run in a process group of their own, so that
+   when one pair fails we can take down the others, which would
+   otherwise wait for it at the start barrier forever.  Being out of
+   our group also keeps them out of the terminal's, so pass on
+   anything which would have stopped them. */
+static pid_t *instance_pids;
+static int nr_instances;
+
+static void
+kill_instances(void)
+{
+  for (int i = 0; i < nr_instances; i++)
+    if (instance_pids[i] > 0)
+      kill(-instance_pids[i], SIGKILL);
+}
+
+static void
+kill_instances_on_signal(int sig)
+{
+  kill_instances();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void
+start_instances(int nr)
+{
+  instance_pids = calloc(nr, sizeof(instance_pids[0]));
+  if (!instance_pids)
+    err(1, "calloc");
+  nr_instances = nr;
+  signal(SIGINT, kill_instances_on_signal);
+  signal(SIGTERM, kill_instances_on_signal);
+  signal(SIGHUP, kill_instances_on_signal);
+}
+
+/* Fork instance num, into a process group of its own if there are
+   others to clean up after.  Returns 0 in the instance, like fork(). */
+static pid_t
+fork_instance(int num)
+{
+  pid_t pid = fork ();
+
+  if (pid < 0)
+    err(1, "fork()");
+  if (!instance_pids)
+    return pid;
+  /* From both sides, so that there's no window where a kill would
+     miss it */
+  if (!pid) {
+    setpgid(0, 0);
+    return 0;
+  }
+  setpgid(pid, pid);
+  instance_pids[num - 1] = pid;
+  return pid;
+}
+
+/* Like wait_for_children_to_finish(), but killing what's left of the
+   other instances as soon as one of them fails.  Gives up there and
+   then, unless keep_going, in which case it returns how many failed. */
+static int
+wait_for_instances(int keep_going)
+{
+  int status, rv;
+  int failed = 0;
+
+  while (1) {
+    rv = waitpid(-1, &status, 0);
+    if (rv < 0) {
+      if (errno == ECHILD)
+	break;
+      err(1, "waitpid()");
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      continue;
+    if (!failed++)
+      kill_instances();
+    if (keep_going)
+      continue;
+    if (WIFSIGNALED(status))
+      errx(1, "child killed by signal %d", WTERMSIG(status));
+    if (WIFEXITED(status))
+      errx(1, "child exited with status %d", WEXITSTATUS(status));
+    errx(1, "unexpected status %x from waitpid", status);
+  }
+  for (int i = 0; i < nr_instances; i++)
+    instance_pids[i] = 0;
+  return failed;
+}
+
 static void stosmemset(void* buf, int byte, size_t count) {
 #ifdef USE_INLINE_ASM
   int clobber;
@@ -85,101 +487,325 @@ static void stosmemset(void* buf, int byte, size_t count) {
 #endif
 }
 
-static int repmemcmp(void* buf, int byte, size_t count) {
-#ifdef USE_INLINE_ASM
-  unsigned long clobber;
-  void* clobber2;
-  char result;
-  assert(count % 8 == 0);
-  asm ("repe scasq\n"
-       "setne %%al\n"
-       : "=a" (result),
-	 "=c" (clobber),
-	 "=D" (clobber2)
-       : "a" ((unsigned long)(byte & 0xff) * 0x0101010101010101ul),
-	 "c" (count / 8),
-	 "D" (buf)
-       );
-  return result;
-#else
-  errx(1, "repmemcmp: not implemented");
-#endif
+/* Fill in message i.  in_place says whether bufs are the transport's
+   own, which are worth streaming into. */
+static void
+produce_message(const test_data *td, struct iovec *bufs, int n_bufs, int i,
+		int in_place)
+{
+  for(int j = 0; j < n_bufs; j++) {
+    if(td->produce_method == PRODUCE_GLIBC_MEMSET)
+      memset(bufs[j].iov_base, (char)i, bufs[j].iov_len);
+    else if(td->produce_method == PRODUCE_STOS_MEMSET)
+      stosmemset(bufs[j].iov_base, (char)i, bufs[j].iov_len);
+    else if(td->produce_method == PRODUCE_LOOP) {
+      for(int k = 0; k < bufs[j].iov_len; k++)
+	((char*)bufs[j].iov_base)[k] = (char)i;
+    }
+    else if(td->produce_method == PRODUCE_KERNEL) {
+      /* Only stream straight into the transport's buffers; the
+	 private buffer is about to be read back again. */
+      if(in_place && streaming(td) && (td->nt_mode & NT_STORES))
+	stream_fill(bufs[j].iov_base, i, bufs[j].iov_len);
+      else
+	td->kernel->fill(bufs[j].iov_base, i, bufs[j].iov_len);
+    }
+    else {
+      assert(0 && "Bad produce method!");
+    }
+  }
+}
+
+/* Copy size bytes from src into the transport, a fragment at a time */
+static void
+send_fragments(test_t *test, test_data *td, const char *src, int size)
+{
+  for(int offset = 0; offset < size; ) {
+    int len = size - offset < td->fragment ? size - offset : td->fragment;
+    struct iovec *write_bufs;
+    int n_write_bufs;
+
+    write_bufs = test->get_write_buffer(td, len, &n_write_bufs);
+    for(int j = 0; j < n_write_bufs; j++) {
+      copy_payload(td, write_bufs[j].iov_base, src + offset, write_bufs[j].iov_len);
+      offset += write_bufs[j].iov_len;
+    }
+    test->release_write_buffer(td, write_bufs, n_write_bufs);
+  }
+}
+
+static void
+report_stamp(int i, int res, const struct msg_stamp *st)
+{
+  switch(res) {
+  case STAMP_BAD_SEQ:
+    errx(1, "message %d has sequence number %" PRIu64, i, st->seq);
+  case STAMP_BAD_LEN:
+    errx(1, "message %d claims to be %u bytes", i, st->len);
+  case STAMP_BAD_CRC:
+    errx(1, "message %d fails its checksum", i);
+  }
+}
+
+/* Receive message i, size bytes of it, a fragment at a time, either
+   putting it back together in dst or, if dst is NULL, checking each
+   fragment where it lies. */
+static void
+receive_fragments(test_t *test, test_data *td, char *dst, int size, int i)
+{
+  struct stamp_check sc;
+  struct msg_stamp st;
+
+  check_start(&sc);
+  for(int offset = 0; offset < size; ) {
+    int len = size - offset < td->fragment ? size - offset : td->fragment;
+    struct iovec *read_bufs;
+    int n_read_bufs;
+    int got = 0;
+
+    read_bufs = test->get_read_buffer(td, len, &n_read_bufs);
+    for(int j = 0; j < n_read_bufs; j++)
+      got += read_bufs[j].iov_len;
+    if(got != len)
+      errx(1, "fragment of message %d at %d is %d bytes, not %d", i, offset, got, len);
+    if(dst) {
+      for(int j = 0; j < n_read_bufs; j++) {
+	copy_payload(td, dst + offset, read_bufs[j].iov_base, read_bufs[j].iov_len);
+	offset += read_bufs[j].iov_len;
+      }
+    }
+    else {
+      if(td->do_verify == VERIFY_STAMP)
+	check_more(&sc, read_bufs, n_read_bufs);
+      else if(td->do_verify) {
+	for(int j = 0; j < n_read_bufs; j++)
+	  if(td->kernel->check(read_bufs[j].iov_base, i, read_bufs[j].iov_len))
+	    err(1, "bad data");
+      }
+      offset += len;
+    }
+    test->release_read_buffer(td, read_bufs, n_read_bufs);
+  }
+  if(!dst && td->do_verify == VERIFY_STAMP)
+    report_stamp(i, check_finish(&sc, i, &st), &st);
+}
+
+/* Fill in message i, stamp it, and copy it into write_bufs.  Without
+   write_bufs it only gets as far as the private buffer, which we
+   return, for send_fragments() to send from. */
+static char *
+write_message(test_data *td, struct private_pool *pool, int i, int size,
+	      struct iovec *write_bufs, int n_write_bufs)
+{
+  int in_place = td->write_in_place && write_bufs;
+  char *private_buffer = private_pool_buf(pool, td, i);
+  struct iovec private_vec = { .iov_base = private_buffer, .iov_len = size };
+  struct iovec *produce_bufs;
+  int n_produce_bufs;
+
+  if(in_place) {
+    produce_bufs = write_bufs;
+    n_produce_bufs = n_write_bufs;
+  }
+  else if(td->source_cache == CACHE_POOL) {
+    /* Produced long ago, by alloc_private_pool() */
+    produce_bufs = NULL;
+    n_produce_bufs = 0;
+  }
+  else {
+    produce_bufs = &private_vec;
+    n_produce_bufs = 1;
+  }
+
+  produce_message(td, produce_bufs, n_produce_bufs, i, in_place);
+
+  if(td->do_verify == VERIFY_STAMP) {
+    if(in_place)
+      stamp_message(write_bufs, n_write_bufs, i);
+    else
+      stamp_message(&private_vec, 1, i);
+  }
+
+  if(!in_place && td->source_cache == CACHE_COLD)
+    flush_range(private_buffer, td->size);
+  if(!in_place && write_bufs) {
+    int offset = 0;
+    for(int j = 0; j < n_write_bufs; j++) {
+      copy_payload(td, write_bufs[j].iov_base, private_buffer + offset, write_bufs[j].iov_len);
+      offset += write_bufs[j].iov_len;
+    }
+  }
+  return private_buffer;
+}
+
+static void
+check_received(test_data *td, struct iovec *check_bufs, int n_check_bufs, int i)
+{
+  if(td->do_verify == VERIFY_STAMP) {
+    struct msg_stamp st;
+    report_stamp(i, check_message(check_bufs, n_check_bufs, i, &st), &st);
+  }
+  else if(td->do_verify) {
+    for(int j = 0; j < n_check_bufs; j++) {
+      if(td->kernel->check(check_bufs[j].iov_base, i, check_bufs[j].iov_len))
+	err(1, "bad data");
+    }
+  }
+}
+
+/* Copy message i out of read_bufs, unless it's to be read in place,
+   and check it. */
+static void
+read_message(test_data *td, struct private_pool *pool, int i,
+	     struct iovec *read_bufs, int n_read_bufs)
+{
+  struct iovec private_vec;
+  struct iovec *check_bufs;
+  int n_check_bufs;
+  size_t len = 0;
+
+  for(int j = 0; j < n_read_bufs; j++)
+    len += read_bufs[j].iov_len;
+  if(len > td->size)
+    errx(1, "message %d is %zd bytes, bigger than anything we sent", i, len);
+  if(td->read_in_place) {
+    check_bufs = read_bufs;
+    n_check_bufs = n_read_bufs;
+  }
+  else {
+    char *private_buffer = private_pool_buf(pool, td, i);
+    private_vec.iov_base = private_buffer;
+    private_vec.iov_len = len;
+    check_bufs = &private_vec;
+    n_check_bufs = 1;
+    if(td->dest_cache == CACHE_COLD)
+      flush_range(private_buffer, td->size);
+    for(int j = 0, offset = 0; j < n_read_bufs; offset += read_bufs[j].iov_len, j++) {
+      copy_payload(td, private_buffer + offset, read_bufs[j].iov_base, read_bufs[j].iov_len);
+    }
+  }
+  check_received(td, check_bufs, n_check_bufs, i);
+}
+
+/* Which we can only do once we know how big the transport's fragments
+   are */
+static void
+check_batch(test_t *test, test_data *td)
+{
+  if(td->batch <= 1)
+    return;
+  if(!test->get_write_batch)
+    errx(1, "%s can't move messages in batches (-B)", test->name);
+  if(td->fragment && td->size > td->fragment)
+    errx(1, "-B can't carry messages of more than %d bytes", td->fragment);
+  if(td->workload && td->workload->gaps)
+    errx(1, "-g paces messages one at a time, so it can't be used with -B");
 }
 
 void parent_main(test_t* test, test_data* td, int is_latency_test) {
 
-  char* private_buffer = xmalloc(td->size);
+  struct private_pool pool;
   struct timeval start;
   struct timeval stop;						
   unsigned long *iter_cycles;						
   unsigned long delta;	
   unsigned long t = 0;
-  struct iovec private_vec = { .iov_base = private_buffer, .iov_len = td->size };
+  struct workload_cursor wc;
+  uint64_t bytes = 0;
+  uint64_t next_send;
+  struct batch_msg msgs[MAX_BATCH];
+  int nr_drawn = 0;
+  int done;
+  int idle = is_latency_test && td->workload && td->workload->gaps;
+  unsigned long busy = 0;
+  double latency;
+
+  alloc_private_pool(&pool, td, td->source_cache, td->source_pool,
+		     td->source_cache == CACHE_POOL);
+  workload_start(&wc, td->num);
 			
   if(test->init_parent)
     test->init_parent(td);
+  td->fragment = test->max_fragment ? test->max_fragment(td) : 0;
+  check_batch(test, td);
+
+  /* Don't start the clock until every pair is ready to go */
+  if (parallel_state)
+    pthread_barrier_wait(&parallel_state->start_barrier);
     									
   /* calm compiler */							
   iter_cycles = NULL;							
 									
-  if (td->per_iter_timings) {						
+  if (td->per_iter_timings || idle) {
     iter_cycles = calloc(sizeof(iter_cycles[0]), td->count);		
     if (!iter_cycles)							
       err(1, "calloc");						
   }									
+#ifdef Linux
+  /* Or a microsecond's sleep takes fifty */
+  if (idle)
+    prctl(PR_SET_TIMERSLACK, 1);
+#endif
 									
   gettimeofday(&start, NULL);						
-  for (int i = 0; i < td->count; i++) {	
-    if(td->per_iter_timings)
+  next_send = now_ns();
+  for (int i = 0; i < td->count; i += done) {
+    if(idle)
+      idle_for(workload_gap(td->workload, &wc));
+    if(td->per_iter_timings || idle)
       t = rdtsc();
 
-    struct iovec* write_bufs;
-    int n_write_bufs;
-    struct iovec* produce_bufs;
-    int n_produce_bufs;
-
-    if(!is_latency_test) {
-      write_bufs = test->get_write_buffer(td, td->size, &n_write_bufs);
-      if(td->write_in_place) {
-	produce_bufs = write_bufs;
-	n_produce_bufs = n_write_bufs;
+    done = 1;
+    if(is_latency_test) {
+      test->parent_ping(td);
+    }
+    else if(td->batch > 1) {
+      int nr = td->count - i < td->batch ? td->count - i : td->batch;
+      /* Any messages which didn't fit last time are still at the
+	 front of msgs, and keep the sizes we picked for them */
+      for(; nr_drawn < nr; nr_drawn++)
+	msgs[nr_drawn].size = workload_size(td->workload, &wc, td->size, min_message_size(td));
+      done = test->get_write_batch(td, msgs, nr);
+      for(int k = 0; k < done; k++) {
+	write_message(td, &pool, i + k, msgs[k].size, msgs[k].vecs, msgs[k].n_vecs);
+	bytes += msgs[k].size;
       }
-      else {
-	produce_bufs = &private_vec;
-	n_produce_bufs = 1;
+      test->release_write_batch(td, msgs, done);
+      nr_drawn -= done;
+      for(int k = 0; k < nr_drawn; k++)
+	msgs[k].size = msgs[done + k].size;
+    }
+    else {
+      int size = workload_size(td->workload, &wc, td->size, min_message_size(td));
+      /* Open loop: if we fall behind then we don't wait until we've
+	 caught up. */
+      if(td->workload && td->workload->gaps) {
+	next_send += workload_gap(td->workload, &wc);
+	while(now_ns() < next_send)
+	  ;
       }
-
-      for(int j = 0; j < n_produce_bufs; j++) {
-	if(td->produce_method == PRODUCE_GLIBC_MEMSET)
-	  memset(produce_bufs[j].iov_base, (char)i, produce_bufs[j].iov_len);
-	else if(td->produce_method == PRODUCE_STOS_MEMSET)
-	  stosmemset(produce_bufs[j].iov_base, (char)i, produce_bufs[j].iov_len);
-	else if(td->produce_method == PRODUCE_LOOP) {
-	  for(int k = 0; k < produce_bufs[j].iov_len; k++)
-	    ((char*)produce_bufs[j].iov_base)[k] = (char)i;
-	}
-	else {
-	  assert(0 && "Bad produce method!");
-	}
+      bytes += size;
+      if(td->fragment && size > td->fragment) {
+	/* It has to be put together somewhere before it can go a
+	   fragment at a time, so it can't be written in place. */
+	send_fragments(test, td, write_message(td, &pool, i, size, NULL, 0), size);
       }
-
-      if(!td->write_in_place) {
-	int offset = 0;
-	for(int j = 0; j < n_produce_bufs; j++) {
-	  memcpy(((char*)write_bufs[j].iov_base) + offset, private_buffer + offset, write_bufs[j].iov_len);
-	  offset += write_bufs[j].iov_len;
-	}
+      else {
+	struct iovec* write_bufs;
+	int n_write_bufs;
+	write_bufs = test->get_write_buffer(td, size, &n_write_bufs);
+	write_message(td, &pool, i, size, write_bufs, n_write_bufs);
+	test->release_write_buffer(td, write_bufs, n_write_bufs);
       }
-
-      test->release_write_buffer(td, write_bufs, n_write_bufs);
-    }
-    else {
-      test->parent_ping(td);
     }
 
-    if(td->per_iter_timings)
-      iter_cycles[i] = rdtsc() - t;					
-  }									
+    if(td->per_iter_timings || idle) {
+      unsigned long cycles = rdtsc() - t;
+      for(int k = 0; k < done; k++)
+	iter_cycles[i + k] = cycles / done;
+      busy += cycles;
+    }
+  }
 
   if(test->finish_parent)
     test->finish_parent(td);
@@ -188,73 +814,733 @@ void parent_main(test_t* test, test_data* td, int is_latency_test) {
 									
   delta = ((stop.tv_sec - start.tv_sec) * (int64_t) 1000000 +		
 	   stop.tv_usec - start.tv_usec);				
+  /* Not counting the time we spent idle on purpose */
+  if (idle)
+    latency = busy / (get_tsc_freq() * td->count);
+  else
+    latency = delta / (td->count * 1e6);
+
+  if (parallel_state) {
+    struct pair_result *res = &parallel_state->results[td->num - 1];
+    res->start = start;
+    res->stop = stop;
+    res->bytes = bytes;
+    /* Wait for everyone to finish this run, then have one of the
+       pairs summarise it. */
+    pthread_barrier_wait(&parallel_state->start_barrier);
+    if (td->num == 1 && parallel_state->nr_pairs > 1 && !is_latency_test && !tuning)
+      log_parallel_results(td);
+  }
 									
-  if (is_latency_test)								
+  if (tuning)
+    ;
+  else if (is_latency_test)								
     logmsg(td,							
 	   "headline",						
 	   "%s %d %" PRIu64 " %fs\n", td->name, td->size, td->count,
-	   delta / (td->count * 1e6));				
+	   latency);				
   else								
     logmsg(td,							
 	   "headline",						
-	   "%s %d %d %d %d %d %d %d %d %" PRId64 " %" PRId64 " Mbps\n", td->name, td->first_core, td->second_core,
+	   "%s %d %d %d %d %d %d %d %d %" PRId64 " %" PRId64 " Mbps %s\n", td->name, td->first_core, td->second_core,
 	   td->numa_node,
 	   td->size, 
 	   td->produce_method, td->write_in_place, td->read_in_place, td->do_verify, td->count,							
-	   ((((td->count * (int64_t)1e6) / delta) * td->size * 8) / (int64_t) 1e6)); 
+	   (int64_t)(bytes * 8 / delta),
+	   describe_copies(td)); 
+
+  if (sweep) {
+    if (is_latency_test)
+      log_sweep_point(test, td, delta, latency);
+    else
+      log_sweep_point(test, td, delta, (double)bytes * 8 / delta);
+  }
 									
+  if (idle && !tuning)
+    log_idle_latencies(td, iter_cycles);
   if (td->per_iter_timings)						
     dump_tsc_counters(td, iter_cycles, td->count);
+  else
+    free(iter_cycles);
 
+  free(pool.base);
 }
 
 void child_main(test_t* test, test_data* td, int is_latency_test) {
 
-  char* private_buffer = xmalloc(td->size);
-  struct iovec private_vec = { .iov_base = private_buffer, .iov_len = td->size };
+  struct private_pool pool;
+  struct workload_cursor wc;
+  struct batch_msg msgs[MAX_BATCH];
+  int done;
+
+  alloc_private_pool(&pool, td, td->dest_cache, td->dest_pool, 0);
+  workload_start(&wc, td->num);
 
   if(test->init_child)
     test->init_child(td);
+  td->fragment = test->max_fragment ? test->max_fragment(td) : 0;
+  check_batch(test, td);
 
-  for(int i = 0; i < td->count; i++) {
-
-    struct iovec* check_bufs;
-    int n_check_bufs;
-    struct iovec* read_bufs;
-    int n_read_bufs;
+  for(int i = 0; i < td->count; i += done) {
 
-    if(!is_latency_test) {
-      read_bufs = test->get_read_buffer(td, td->size, &n_read_bufs);
-      if(td->read_in_place) {
-	check_bufs = read_bufs;
-	n_check_bufs = n_read_bufs;
+    done = 1;
+    if(is_latency_test) {
+      test->child_ping(td);
+    }
+    else if(td->batch > 1) {
+      int nr = td->count - i < td->batch ? td->count - i : td->batch;
+      done = test->get_read_batch(td, msgs, nr);
+      if(!done)
+	errx(1, "ran out of messages after %d", i);
+      for(int k = 0; k < done; k++)
+	read_message(td, &pool, i + k, msgs[k].vecs, msgs[k].n_vecs);
+      test->release_read_batch(td, msgs, done);
+    }
+    else {
+      /* The same sizes the producer picked, so that stream transports
+	 know how much to read */
+      int size = workload_size(td->workload, &wc, td->size, min_message_size(td));
+      if(td->fragment && size > td->fragment) {
+	/* -r checks each fragment as it arrives; otherwise we put the
+	   message back together and check that */
+	if(td->read_in_place) {
+	  receive_fragments(test, td, NULL, size, i);
+	}
+	else {
+	  struct iovec private_vec;
+	  private_vec.iov_base = private_pool_buf(&pool, td, i);
+	  private_vec.iov_len = size;
+	  if(td->dest_cache == CACHE_COLD)
+	    flush_range(private_vec.iov_base, td->size);
+	  receive_fragments(test, td, private_vec.iov_base, size, i);
+	  check_received(td, &private_vec, 1, i);
+	}
       }
       else {
-	check_bufs = &private_vec;
-	n_check_bufs = 1;
-	for(int j = 0, offset = 0; j < n_read_bufs; offset += read_bufs[j].iov_len, j++) {
-	  memcpy(private_buffer + offset, read_bufs[j].iov_base, read_bufs[j].iov_len);
-	}
+	struct iovec* read_bufs;
+	int n_read_bufs;
+	read_bufs = test->get_read_buffer(td, size, &n_read_bufs);
+	read_message(td, &pool, i, read_bufs, n_read_bufs);
+	test->release_read_buffer(td, read_bufs, n_read_bufs);
       }
+    }
 
-      if(td->do_verify) {
-	for(int j = 0; j < n_check_bufs; j++) {
-	  if(repmemcmp(check_bufs[j].iov_base, i, check_bufs[j].iov_len))
-	    err(1, "bad data");
-	}
+  }
+
+  if(test->finish_child)
+    test->finish_child(td);
+
+  free(pool.base);
+}
+
+/* A sweep is a set of axes, each with a list of values, and we run
+   every point in their cross product.  The tunable axes come first, so
+   that runs of consecutive points share the transport's setup and
+   persistent workers can carry a ring from one point to the next. */
+enum sweep_axis_kind {
+  AXIS_TUNABLE,
+  AXIS_SIZE,
+  AXIS_METHOD,
+  AXIS_WRITE_IN_PLACE,
+  AXIS_READ_IN_PLACE,
+  AXIS_CORES,
+  AXIS_KERNEL,
+  AXIS_NT_THRESHOLD,
+  AXIS_BATCH,
+  AXIS_WAIT,
+};
+
+struct sweep_axis {
+  enum sweep_axis_kind kind;
+  tunable *tunable;
+  int nr_values;
+  int values[64][2];
+};
+
+struct sweep {
+  const char *file;
+  int nr_axes;
+  struct sweep_axis axes[16];
+  int nr_points;
+};
+
+
+static const struct {
+  const char *name;
+  enum sweep_axis_kind kind;
+} sweep_axis_names[] = {
+  { "size", AXIS_SIZE },
+  { "method", AXIS_METHOD },
+  { "write_in_place", AXIS_WRITE_IN_PLACE },
+  { "read_in_place", AXIS_READ_IN_PLACE },
+  { "cores", AXIS_CORES },
+  { "kernel", AXIS_KERNEL },
+  { "nt_threshold", AXIS_NT_THRESHOLD },
+  { "batch", AXIS_BATCH },
+  { "wait", AXIS_WAIT },
+};
+
+static tunable *
+find_tunable(test_t *test, const char *name)
+{
+  tunable *t;
+
+  for (t = test->tunables; t && t->name; t++)
+    if (!strcmp(t->name, name))
+      return t;
+  return NULL;
+}
+
+static void
+check_wait_strategy(test_t *test, int kind)
+{
+  if (!test->wait_strategies)
+    errx(1, "%s doesn't wait on shared memory, so -W means nothing to it", test->name);
+  if (!(test->wait_strategies & (1 << kind)))
+    errx(1, "%s can't wait with %s", test->name, wait_strategy_names[kind]);
+  if (!wait_strategy_supported(kind))
+    errx(1, "can't wait with %s on this machine", wait_strategy_names[kind]);
+}
+
+/* Sweep files have one axis per line: a name followed by the values
+   to try, e.g.
+
+     size 64 1024 65536
+     method 1 2
+     cores 0:1 0:2
+     kernel glibc avx2
+     wait pause futex futex:1000
+     MEMPIPE_RING_ORDER 6 9 12
+
+   Tunables are named by the environment variable which would
+   otherwise set them. */
+static struct sweep *
+load_sweep(test_t *test, const char *file)
+{
+  struct sweep *sw = xmalloc(sizeof(*sw));
+  char *line = NULL;
+  size_t line_sz = 0;
+  int lineno = 0;
+  FILE *f;
+  int i;
+
+  memset(sw, 0, sizeof(*sw));
+  sw->file = file;
+  f = fopen(file, "r");
+  if (!f)
+    err(1, "opening sweep file %s", file);
+  while (getline(&line, &line_sz, f) > 0) {
+    struct sweep_axis *ax;
+    char *tok, *save;
+
+    lineno++;
+    tok = strtok_r(line, " \t\n", &save);
+    if (!tok || tok[0] == '#')
+      continue;
+    if (sw->nr_axes == sizeof(sw->axes) / sizeof(sw->axes[0]))
+      errx(1, "%s:%d: too many axes", file, lineno);
+    ax = &sw->axes[sw->nr_axes];
+    ax->tunable = find_tunable(test, tok);
+    if (ax->tunable) {
+      ax->kind = AXIS_TUNABLE;
+    } else {
+      for (i = 0; i < sizeof(sweep_axis_names) / sizeof(sweep_axis_names[0]); i++)
+	if (!strcmp(sweep_axis_names[i].name, tok))
+	  break;
+      if (i == sizeof(sweep_axis_names) / sizeof(sweep_axis_names[0]))
+	errx(1, "%s:%d: %s is not an axis or a tunable of %s", file, lineno, tok, test->name);
+      ax->kind = sweep_axis_names[i].kind;
+    }
+    while ((tok = strtok_r(NULL, " \t\n", &save))) {
+      int *v;
+      if (ax->nr_values == sizeof(ax->values) / sizeof(ax->values[0]))
+	errx(1, "%s:%d: too many values", file, lineno);
+      v = ax->values[ax->nr_values];
+      if (ax->kind == AXIS_CORES) {
+	if (sscanf(tok, "%d:%d", &v[0], &v[1]) != 2)
+	  errx(1, "%s:%d: cores must be given as <first>:<second>", file, lineno);
+      } else if (ax->kind == AXIS_KERNEL) {
+	const struct kernel *k = find_kernel(tok);
+	if (!k)
+	  errx(1, "%s:%d: no kernel %s on this CPU", file, lineno, tok);
+	v[0] = k - kernels;
+      } else if (ax->kind == AXIS_WAIT) {
+	if (parse_wait_strategy(tok, &v[0], &v[1]))
+	  errx(1, "%s:%d: %s isn't a wait strategy", file, lineno, tok);
+	check_wait_strategy(test, v[0]);
+      } else if (sscanf(tok, "%d", &v[0]) != 1) {
+	errx(1, "%s:%d: bad value %s", file, lineno, tok);
       }
+      if (ax->kind == AXIS_BATCH && (v[0] < 1 || v[0] > MAX_BATCH))
+	errx(1, "%s:%d: batch must be between 1 and %d", file, lineno, MAX_BATCH);
+      if (ax->kind == AXIS_TUNABLE &&
+	  (v[0] < ax->tunable->min || v[0] > ax->tunable->max))
+	errx(1, "%s:%d: %s must be between %d and %d", file, lineno,
+	     ax->tunable->name, ax->tunable->min, ax->tunable->max);
+      ax->nr_values++;
+    }
+    if (!ax->nr_values)
+      errx(1, "%s:%d: no values for %s", file, lineno, line);
+    sw->nr_axes++;
+  }
+  free(line);
+  fclose(f);
+
+  /* Tunables first, keeping the file's order otherwise */
+  for (i = 1; i < sw->nr_axes; i++) {
+    struct sweep_axis ax = sw->axes[i];
+    int j;
+    if (ax.kind != AXIS_TUNABLE)
+      continue;
+    for (j = i; j > 0 && sw->axes[j - 1].kind != AXIS_TUNABLE; j--)
+      sw->axes[j] = sw->axes[j - 1];
+    sw->axes[j] = ax;
+  }
+
+  sw->nr_points = 1;
+  for (i = 0; i < sw->nr_axes; i++)
+    sw->nr_points *= sw->axes[i].nr_values;
+  return sw;
+}
+
+/* Point n of the sweep, with the first axis varying slowest. */
+static const int *
+sweep_value(const struct sweep *sw, int axis, int point)
+{
+  int i;
+
+  for (i = sw->nr_axes - 1; i > axis; i--)
+    point /= sw->axes[i].nr_values;
+  return sw->axes[axis].values[point % sw->axes[axis].nr_values];
+}
+
+static void
+apply_tunables(const struct sweep *sw, int point)
+{
+  int i;
 
-      test->release_read_buffer(td, read_bufs, n_read_bufs);
+  for (i = 0; i < sw->nr_axes; i++)
+    if (sw->axes[i].kind == AXIS_TUNABLE)
+      *sw->axes[i].tunable->value = sweep_value(sw, i, point)[0];
+}
+
+static int
+same_tunables(const struct sweep *sw, int a, int b)
+{
+  int i;
+
+  for (i = 0; i < sw->nr_axes; i++)
+    if (sw->axes[i].kind == AXIS_TUNABLE &&
+	sweep_value(sw, i, a)[0] != sweep_value(sw, i, b)[0])
+      return 0;
+  return 1;
+}
+
+/* Set up td for one point of the run, starting from the options on
+   the command line. */
+static void
+apply_point(test_data *td, const test_data *base, int point)
+{
+  int i;
+
+  td->size = base->size;
+  td->produce_method = base->produce_method;
+  td->write_in_place = base->write_in_place;
+  td->read_in_place = base->read_in_place;
+  td->first_core = base->first_core;
+  td->second_core = base->second_core;
+  td->kernel = base->kernel;
+  td->nt_threshold = base->nt_threshold;
+  td->batch = base->batch;
+  td->wait_strategy = base->wait_strategy;
+  td->spin_budget = base->spin_budget;
+  td->point = point;
+  if (!sweep)
+    return;
+  for (i = 0; i < sweep->nr_axes; i++) {
+    const int *v = sweep_value(sweep, i, point);
+    switch (sweep->axes[i].kind) {
+    case AXIS_TUNABLE:
+      break;
+    case AXIS_SIZE:
+      td->size = v[0];
+      break;
+    case AXIS_METHOD:
+      td->produce_method = v[0];
+      break;
+    case AXIS_WRITE_IN_PLACE:
+      td->write_in_place = v[0];
+      break;
+    case AXIS_READ_IN_PLACE:
+      td->read_in_place = v[0];
+      break;
+    case AXIS_CORES:
+      td->first_core = v[0];
+      td->second_core = v[1];
+      break;
+    case AXIS_KERNEL:
+      td->kernel = &kernels[v[0]];
+      break;
+    case AXIS_NT_THRESHOLD:
+      td->nt_threshold = v[0];
+      break;
+    case AXIS_BATCH:
+      td->batch = v[0];
+      break;
+    case AXIS_WAIT:
+      td->wait_strategy = v[0];
+      td->spin_budget = v[1];
+      break;
     }
-    else {
-      test->child_ping(td);
+  }
+}
+
+static void
+log_sweep_header(test_t *test, const char *output_dir, const char *name)
+{
+  test_data td;
+  tunable *t;
+  char *cols = strdup("");
+  char *tmp;
+
+  for (t = test->tunables; t && t->name; t++) {
+    if (asprintf(&tmp, "%s,%s", cols, t->name) < 0)
+      err(1, "asprintf()");
+    free(cols);
+    cols = tmp;
+  }
+  memset(&td, 0, sizeof(td));
+  td.output_dir = output_dir;
+  td.name = name;
+  logmsg(&td, "sweep",
+	 "name,instance,point,first_core,second_core,numa_node,size,produce_method,kernel,nt_mode,nt_threshold,"
+	 "source_cache,dest_cache,sizes,gaps,batch,wait,"
+	 "write_in_place,read_in_place,do_verify,threaded,count%s,usecs,result\n",
+	 cols);
+  free(cols);
+}
+
+static void
+log_sweep_point(test_t *test, test_data *td, unsigned long delta, double result)
+{
+  test_data sweep_td = *td;
+  tunable *t;
+  char *cols = strdup("");
+  char *tmp;
+  char src[32], dst[32];
+
+  for (t = test->tunables; t && t->name; t++) {
+    if (asprintf(&tmp, "%s,%d", cols, *t->value) < 0)
+      err(1, "asprintf()");
+    free(cols);
+    cols = tmp;
+  }
+  /* Everyone shares one file */
+  sweep_td.num = 0;
+  logmsg(&sweep_td, "sweep",
+	 "%s,%d,%d,%d,%d,%d,%d,%d,%s,%d,%d,%s,%s,%s,%s,%d,%s,%d,%d,%d,%d,%" PRIu64 "%s,%lu,%f\n",
+	 td->name, td->num, td->point, td->first_core, td->second_core,
+	 td->numa_node, td->size, td->produce_method, td->kernel->name,
+	 td->nt_mode, td->nt_threshold,
+	 describe_cache_mode(src, sizeof(src), td->source_cache, td->source_pool),
+	 describe_cache_mode(dst, sizeof(dst), td->dest_cache, td->dest_pool),
+	 td->workload && td->workload->sizes ? td->workload->sizes->spec : "",
+	 td->workload && td->workload->gaps ? td->workload->gaps->spec : "",
+	 td->batch, describe_wait(td), td->write_in_place,
+	 td->read_in_place, td->do_verify, td->threaded, td->count, cols,
+	 delta, result);
+  free(cols);
+}
+
+static void
+run_child_points(test_t *test, test_data *td, const test_data *base,
+		 int first_point, int nr_points)
+{
+  int p;
+
+  for (p = first_point; p < first_point + nr_points; p++) {
+    apply_point(td, base, p);
+    setaffinity(td->first_core);
+    child_main(test, td, test->is_latency_test);
+  }
+}
+
+static void
+run_parent_points(test_t *test, test_data *td, const test_data *base,
+		  int first_point, int nr_points)
+{
+  int p;
+
+  for (p = first_point; p < first_point + nr_points; p++) {
+    apply_point(td, base, p);
+    setaffinity(td->second_core);
+    parent_main(test, td, test->is_latency_test);
+  }
+}
+
+struct child_thread_args {
+  test_t *test;
+  test_data *td;
+  const test_data *base;
+  int first_point;
+  int nr_points;
+};
+
+static void *
+child_thread(void *_args)
+{
+  struct child_thread_args *args = _args;
+
+  run_child_points(args->test, args->td, args->base, args->first_point,
+		   args->nr_points);
+  return NULL;
+}
+
+/* Run the two halves of a test as threads of the current process.
+   The child thread gets its own copy of td and of the transport
+   state, so it sees the same thing it would have seen after a
+   fork(), except that the address space (and so the page tables and
+   any heap-allocated rings) is shared. */
+static void
+run_threaded_pair(test_t *test, test_data *td, const test_data *base,
+		  int first_point, int nr_points)
+{
+  struct child_thread_args args;
+  test_data *child_td;
+  pthread_t thread;
+  int r;
+
+  child_td = xmalloc(sizeof(test_data));
+  *child_td = *td;
+  if (test->data_size) {
+    child_td->data = xmalloc(test->data_size);
+    memcpy(child_td->data, td->data, test->data_size);
+  }
+
+  args.test = test;
+  args.td = child_td;
+  args.base = base;
+  args.first_point = first_point;
+  args.nr_points = nr_points;
+  r = pthread_create(&thread, NULL, child_thread, &args);
+  if (r != 0)
+    errx(1, "pthread_create: %s", strerror(r));
+
+  run_parent_points(test, td, base, first_point, nr_points);
+
+  r = pthread_join(thread, NULL);
+  if (r != 0)
+    errx(1, "pthread_join: %s", strerror(r));
+}
+
+/* One parallel instance of the test, covering a run of points which
+   all share the same transport setup. */
+static void
+run_instance(test_t *test, const test_data *base, int num, int first_point,
+	     int nr_points)
+{
+  test_data *td = xmalloc(sizeof(test_data));
+
+  *td = *base;
+  td->num = num;
+  apply_point(td, base, first_point);
+
+  /* Test-specific init */
+  test->init_test(td); 
+  if (td->threaded) {
+    run_threaded_pair(test, td, base, first_point, nr_points);
+    return;
+  }
+  pid_t pid2 = fork ();
+  td->child_pid = pid2;
+  if (!pid2) { /* child2 */
+    /* The child isn't supposed to log anything. */
+    td->output_dir = NULL;
+    run_child_points(test, td, base, first_point, nr_points);
+    exit (0);
+  } else { /* parent2 */
+    run_parent_points(test, td, base, first_point, nr_points);
+    wait_for_children_to_finish();
+  }
+}
+
+#define TUNE_TRIALS 3
+#define TUNE_MIN_GAIN 0.02
+#define TUNE_MAX_ROUNDS 8
+
+/* Run the test once with the current tunables and return its total
+   throughput in Mbps (or, for latency tests, round trips per second),
+   or -1 if any part of it failed. */
+static double
+run_trial(test_t *test, const test_data *base, int parallel)
+{
+  double total = 0;
+  int num;
+
+  for (num = parallel; num > 0; num--) {
+    if (!fork_instance(num)) {
+      run_instance(test, base, num, 0, 1);
+      exit (0);
     }
+  }
+  if (wait_for_instances(1)) {
+    init_start_barrier(parallel);
+    return -1;
+  }
 
+  for (num = 0; num < parallel; num++) {
+    struct pair_result *res = &parallel_state->results[num];
+    double secs = tv_to_secs(&res->stop) - tv_to_secs(&res->start);
+    if (test->is_latency_test)
+      total += base->count / secs;
+    else
+      total += res->bytes * 8 / (secs * 1e6);
   }
+  return total;
+}
 
-  if(test->finish_child)
-    test->finish_child(td);
+/* Median of a few trials, since single short runs are noisy */
+static double
+measure_config(test_t *test, const test_data *base, int parallel)
+{
+  double scores[TUNE_TRIALS];
+  int i;
+
+  for (i = 0; i < TUNE_TRIALS; i++) {
+    scores[i] = run_trial(test, base, parallel);
+    if (scores[i] < 0)
+      return -1;
+  }
+  qsort(scores, TUNE_TRIALS, sizeof(scores[0]), cmp_double);
+  return scores[TUNE_TRIALS / 2];
+}
 
+static char *
+describe_config(test_t *test)
+{
+  char *res = strdup("");
+  char *tmp;
+  tunable *t;
+
+  for (t = test->tunables; t->name; t++) {
+    if (asprintf(&tmp, "%s%s%s=%d", res, res[0] ? " " : "", t->name, *t->value) < 0)
+      err(1, "asprintf()");
+    free(res);
+    res = tmp;
+  }
+  return res;
+}
+
+static int
+tunable_step(const tunable *t, int v, int dir)
+{
+  if (t->geometric)
+    v = dir > 0 ? v * 2 : v / 2;
+  else
+    v += dir;
+  if (v < t->min)
+    v = t->min;
+  if (v > t->max)
+    v = t->max;
+  return v;
+}
+
+/* Hill-climb over the transport's tunables for the size and cores
+   given on the command line: try moving each tunable a step either
+   way, keep going while that helps by more than TUNE_MIN_GAIN, and
+   repeat until nothing helps.  Noise can make a move look like an
+   improvement, so bound the number of rounds, and measure the winner
+   again at the end rather than reporting its luckiest score. */
+static void
+run_tuner(test_t *test, const test_data *base, int parallel)
+{
+  test_data log_td = *base;
+  double baseline, best, score;
+  char *desc;
+  tunable *t;
+  int improved, round = 0;
+
+  if (!test->tunables || !test->tunables[0].name)
+    errx(1, "%s has nothing to tune", test->name);
+
+  tuning = 1;
+  baseline = best = measure_config(test, base, parallel);
+  if (baseline < 0)
+    errx(1, "test failed with its starting configuration");
+  desc = describe_config(test);
+  logmsg(&log_td, "tune", "%s %d %d %d start %s %f\n", base->name, base->size,
+	 base->first_core, base->second_core, desc, baseline);
+  free(desc);
+
+  do {
+    improved = 0;
+    for (t = test->tunables; t->name; t++) {
+      for (int dir = -1; dir <= 1; dir += 2) {
+	while (1) {
+	  int old = *t->value;
+	  *t->value = tunable_step(t, old, dir);
+	  if (*t->value == old)
+	    break;
+	  score = measure_config(test, base, parallel);
+	  desc = describe_config(test);
+	  logmsg(&log_td, "tune", "%s %d %d %d trial %s %f\n", base->name, base->size,
+		 base->first_core, base->second_core, desc, score);
+	  free(desc);
+	  if (score <= best * (1 + TUNE_MIN_GAIN)) {
+	    *t->value = old;
+	    break;
+	  }
+	  best = score;
+	  improved = 1;
+	}
+      }
+    }
+  } while (improved && ++round < TUNE_MAX_ROUNDS);
+
+  best = measure_config(test, base, parallel);
+  if (best < 0)
+    errx(1, "test failed with its best configuration");
+  desc = describe_config(test);
+  logmsg(&log_td, "tune", "%s %d %d %d best %s %f gain %.1f%%\n", base->name, base->size,
+	 base->first_core, base->second_core, desc, best, (best / baseline - 1) * 100);
+  printf("%s\n", desc);
+  fprintf(stderr, "%s: best %f vs %f to start with (%+.1f%%)\n", base->name, best,
+	  baseline, (best / baseline - 1) * 100);
+  free(desc);
+}
+
+/* -C and -D: hot, cold or pool:<bytes>, where bytes can have a k, m
+   or g suffix */
+static void
+parse_cache_mode(const char *opt, const char *arg, int *mode, size_t *pool)
+{
+  unsigned long long n;
+  char *end;
+
+  if (!arg || !strcmp(arg, "hot")) {
+    *mode = CACHE_HOT;
+  } else if (!strcmp(arg, "cold")) {
+    *mode = CACHE_COLD;
+  } else if (!strncmp(arg, "pool:", 5)) {
+    *mode = CACHE_POOL;
+    n = strtoull(arg + 5, &end, 0);
+    switch (*end) {
+    case 'g': case 'G':
+      n <<= 10;
+      /* fall through */
+    case 'm': case 'M':
+      n <<= 10;
+      /* fall through */
+    case 'k': case 'K':
+      n <<= 10;
+      end++;
+    }
+    if (end == arg + 5 || *end || !n)
+      errx(1, "%s wants pool:<bytes>, not %s", opt, arg);
+    *pool = n;
+  } else {
+    errx(1, "%s wants hot, cold or pool:<bytes>, not %s", opt, arg);
+  }
 }
 
 /* Execute a test with as many parallel iterations as requested */
@@ -268,60 +1554,178 @@ run_test(int argc, char *argv[], test_t *test)
   char *output_dir;
   int write_in_place, read_in_place, produce_method, do_verify;
   int numa_node;
+  int threaded;
+  char *sweep_file;
+  int tune;
+  char *kernel;
+  char *nt;
+  char *source_cache, *dest_cache;
+  char *sizes, *gaps;
+  int batch;
+  char *wait;
+  struct workload workload;
+  char *name;
+  test_data base;
+  tunable *t;
+  int nr_points, point, group;
+
+  for (t = test->tunables; t && t->name; t++) {
+    char *s = getenv(t->name);
+    if (s) {
+      if (sscanf(s, "%d", t->value) != 1)
+	errx(1, "%s must be an integer", t->name);
+      if (*t->value < t->min || *t->value > t->max)
+	errx(1, "%s must be between %d and %d", t->name, t->min, t->max);
+    }
+  }
 
   parse_args(argc, argv, &per_iter_timings, &size, &count, &first_cpu, &second_cpu, &parallel, &output_dir,
-	     &write_in_place, &read_in_place, &produce_method, &do_verify, &numa_node);
+	     &write_in_place, &read_in_place, &produce_method, &do_verify, &numa_node, &threaded,
+	     &sweep_file, &tune, &kernel, &nt, &source_cache, &dest_cache, &sizes, &gaps, &batch,
+	     &wait);
+
+  if (sweep_file && tune)
+    errx(1, "can't sweep (-x) and tune (-u) at the same time");
+
+  if (sweep_file)
+    sweep = load_sweep(test, sweep_file);
+
+  if((!test->is_latency_test) && (!(produce_method >= 1 && produce_method <= 4))) {
+    fprintf(stderr, "Produce method (option -m) must be specified and between 1 and 4\n");
+    exit(1);
+  }
 
-  if((!test->is_latency_test) && (!(produce_method >= 1 && produce_method <= 3))) {
-    fprintf(stderr, "Produce method (option -m) must be specified and between 1 and 3\n");
+  memset(&base, 0, sizeof(base));
+  base.kernel = find_kernel(kernel);
+  if (!base.kernel) {
+    fprintf(stderr, "No kernel %s on this CPU; try one of", kernel);
+    list_kernels(stderr);
     exit(1);
   }
+  if (nt) {
+    char mode[16];
+    int n = sscanf(nt, "%15[a-z]:%d", mode, &base.nt_threshold);
+    if (n < 1)
+      errx(1, "-N wants store, load or both, optionally followed by :<bytes>");
+    if (!strcmp(mode, "store"))
+      base.nt_mode = NT_STORES;
+    else if (!strcmp(mode, "load"))
+      base.nt_mode = NT_LOADS;
+    else if (!strcmp(mode, "both"))
+      base.nt_mode = NT_STORES | NT_LOADS;
+    else
+      errx(1, "-N wants store, load or both, not %s", mode);
+    if (!stream_supported(base.nt_mode))
+      errx(1, "this CPU can't do %s non-temporal copies", mode);
+  }
+  if (sizes || gaps) {
+    if (test->is_latency_test && sizes)
+      errx(1, "-d is for throughput tests");
+    workload.sizes = sizes ? parse_distribution("-d", sizes) : NULL;
+    workload.gaps = gaps ? parse_distribution("-g", gaps) : NULL;
+    base.workload = &workload;
+    if (workload.sizes) {
+      if (!test->variable_size && workload.sizes->min != workload.sizes->max)
+	errx(1, "%s can only move messages of one size, so -d can't vary them",
+	     test->name);
+      /* Buffers have to be big enough for the biggest message */
+      if (workload.sizes->max > INT_MAX)
+	errx(1, "-d: messages can't be bigger than %d bytes", INT_MAX);
+      size = workload.sizes->max < 1 ? 1 : workload.sizes->max;
+      if (do_verify == VERIFY_STAMP && size < (int)sizeof(struct msg_stamp))
+	size = sizeof(struct msg_stamp);
+      if (sweep)
+	for (int i = 0; i < sweep->nr_axes; i++)
+	  if (sweep->axes[i].kind == AXIS_SIZE)
+	    errx(1, "-d picks the sizes, so the sweep can't vary them");
+    }
+  }
+  /* With -d, small messages get rounded up to fit the stamp */
+  if (do_verify == VERIFY_STAMP && !test->is_latency_test && !sizes) {
+    int smallest = size;
+    if (sweep)
+      for (int i = 0; i < sweep->nr_axes; i++)
+	for (int j = 0; j < sweep->axes[i].nr_values; j++)
+	  if (sweep->axes[i].kind == AXIS_SIZE && sweep->axes[i].values[j][0] < smallest)
+	    smallest = sweep->axes[i].values[j][0];
+    if (smallest < (int)sizeof(struct msg_stamp))
+      errx(1, "-V needs messages of at least %zd bytes", sizeof(struct msg_stamp));
+  }
+  if (batch < 1 || batch > MAX_BATCH)
+    errx(1, "-B must be between 1 and %d", MAX_BATCH);
+  if (batch > 1 && test->is_latency_test)
+    errx(1, "-B is for throughput tests");
+  base.batch = batch;
+  base.wait_strategy = -1;
+  if (wait) {
+    if (parse_wait_strategy(wait, &base.wait_strategy, &base.spin_budget))
+      errx(1, "-W wants spin, pause, yield, futex[:<spins>], umwait or adaptive, not %s", wait);
+    check_wait_strategy(test, base.wait_strategy);
+  }
+  parse_cache_mode("-C", source_cache, &base.source_cache, &base.source_pool);
+  parse_cache_mode("-D", dest_cache, &base.dest_cache, &base.dest_pool);
 
   if (mkdir(output_dir, 0755) < 0 && errno != EEXIST)
     err(1, "creating directory %s", output_dir);
 
-  while (parallel > 0) {
-    pid_t pid1 = fork ();
-    if (!pid1) { /* child1 */
-      /* Initialise a test run */
-      test_data *td = xmalloc(sizeof(test_data));
-      memset(td, 0, sizeof(test_data));
-      td->num = parallel;
-      td->size = size;
-      td->count = count;
-      td->write_in_place = write_in_place;
-      td->read_in_place = read_in_place;
-      td->produce_method = produce_method;
-      td->do_verify = do_verify;
-      td->first_core = first_cpu;
-      td->second_core = second_cpu;
-      td->per_iter_timings = per_iter_timings;
-      //      td->mode = mode;
-      td->numa_node = numa_node;
-
-      /* Test-specific init */
-      test->init_test(td); 
-      pid_t pid2 = fork ();
-      if (!pid2) { /* child2 */
-        setaffinity(first_cpu);
-	child_main(test, td, test->is_latency_test);
-        exit (0);
-      } else { /* parent2 */
-	td->output_dir = output_dir; /* Do this here because the child
-					isn't supposed to log
-					anything. */
-	td->name = test->name;
-        setaffinity(second_cpu);
-	parent_main(test, td, test->is_latency_test);
-
-	wait_for_children_to_finish();
-
-        exit (0);
+  if (threaded) {
+    if (asprintf(&name, "%s_threaded", test->name) < 0)
+      err(1, "asprintf()");
+  } else {
+    name = (char *)test->name;
+  }
+
+  if (parallel > 1 || tune) {
+    init_parallel_state(parallel);
+    start_instances(parallel);
+  }
+
+  /* Calibrate once, rather than in every process */
+  if (per_iter_timings)
+    get_tsc_freq();
+
+  base.size = size;
+  base.count = count;
+  base.write_in_place = write_in_place;
+  base.read_in_place = read_in_place;
+  base.produce_method = produce_method;
+  base.do_verify = do_verify;
+  base.first_core = first_cpu;
+  base.second_core = second_cpu;
+  base.per_iter_timings = per_iter_timings;
+  base.numa_node = numa_node;
+  base.threaded = threaded;
+  base.output_dir = output_dir;
+  base.name = name;
+
+  if (tune) {
+    run_tuner(test, &base, parallel);
+    return;
+  }
+
+  nr_points = 1;
+  if (sweep) {
+    nr_points = sweep->nr_points;
+    log_sweep_header(test, output_dir, name);
+  }
+
+  /* Each group of points shares its tunables, and so its transport
+     setup.  If the transport can be reused, one set of workers runs
+     the whole group; otherwise every point gets fresh workers. */
+  for (point = 0; point < nr_points; point += group) {
+    group = 1;
+    if (sweep) {
+      apply_tunables(sweep, point);
+      if (test->reusable)
+	while (point + group < nr_points && same_tunables(sweep, point, point + group))
+	  group++;
+    }
+    for (int num = parallel; num > 0; num--) {
+      if (!fork_instance(num)) { /* child1 */
+	run_instance(test, &base, num, point, group);
+	exit (0);
       }
-    } else { /* parent */ 
-      /* continue to fork */
-      parallel--;
     }
+    wait_for_instances(0);
   }
-  wait_for_children_to_finish();
 }
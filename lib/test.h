@@ -24,10 +24,26 @@
  */
 
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define PRODUCE_GLIBC_MEMSET 1
 #define PRODUCE_STOS_MEMSET 2
 #define PRODUCE_LOOP 3
+#define PRODUCE_KERNEL 4 /* The fill from the selected kernel */
+
+/* What -v and -V set do_verify to */
+#define VERIFY_PATTERN 1 /* Every byte of message i is (char)i */
+#define VERIFY_STAMP 2 /* Sequence number and CRC, see verify.h */
+
+/* Where the producer's source and the consumer's destination are
+   in the cache when we copy to or from them */
+#define CACHE_HOT 0 /* One buffer, used over and over again */
+#define CACHE_COLD 1 /* Flushed before every use */
+#define CACHE_POOL 2 /* Step through a pool of them */
+
+struct kernel;
+struct workload;
 
 typedef struct {
   int num;
@@ -44,11 +60,67 @@ typedef struct {
   int first_core;
   int second_core;
   int numa_node;
+  int threaded;
+  int point;
+  const struct kernel *kernel; /* Copies and checks the payload */
+  int nt_mode; /* NT_STORES and/or NT_LOADS, for messages... */
+  int nt_threshold; /* ...of at least this many bytes */
+  int source_cache, dest_cache;
+  size_t source_pool, dest_pool; /* Bytes, for CACHE_POOL */
+  const struct workload *workload; /* NULL for -s sized messages back to back */
+  int fragment; /* Bigger messages go a piece at a time; 0 for no limit */
+  int batch; /* Messages to move per call, with -B */
+  int wait_strategy; /* A WAIT_ from futex.h, or -1 for the transport's own choice... */
+  int spin_budget; /* ...and how long WAIT_FUTEX spins before it sleeps */
+  pid_t child_pid; /* The parent's, in process mode */
 } test_data;
 
+#define MAX_BATCH 64
+
+/* One message of a batch.  Two vecs are enough for a ring which
+   wraps. */
+struct batch_msg {
+  int size;
+  int n_vecs;
+  struct iovec vecs[2];
+};
+
+/* A knob which a transport exposes to the harness, so that it can be
+   set from the environment variable of the same name or varied by a
+   sweep. */
+typedef struct {
+  const char *name;
+  int *value;
+  int min;
+  int max;
+  int geometric; /* Explore by doubling and halving rather than +/-1 */
+} tunable;
+
 typedef struct {
   const char *name;
   int is_latency_test;
+  /* Size of the per-endpoint state hung off td->data by init_test.
+     In thread mode the child gets its own copy of this much state,
+     just as it would after a fork(); zero means the two ends share
+     td->data as-is. */
+  size_t data_size;
+  /* Set if init_parent and init_child can be run again on the state
+     left behind by a previous run, so that one set of workers can run
+     several points of a sweep without setting the transport up again. */
+  int reusable;
+  /* Set if get_write_buffer will take any size of message, rather than
+     only td->size, and get_read_buffer hands back messages of whatever
+     size they were sent at.  -d won't vary the size otherwise. */
+  int variable_size;
+  /* The biggest message which the transport, as set up by init_parent
+     or init_child, can move in one go.  The harness splits anything
+     bigger into fragments of this size and puts it back together at
+     the other end.  NULL for no limit. */
+  int (*max_fragment)(test_data *);
+  tunable *tunables;
+  /* The WAIT_s, as a mask of 1 << WAIT_ bits, which -W can pick for
+     a transport which waits on shared memory itself */
+  int wait_strategies;
   void (*init_test)(test_data *);
   void (*init_parent)(test_data *);
   void (*finish_parent)(test_data *);
@@ -58,6 +130,17 @@ typedef struct {
   void (*release_write_buffer)(test_data *, struct iovec* vecs, int n_vecs);
   struct iovec* (*get_read_buffer)(test_data *, int size, int* n_vecs);
   void (*release_read_buffer)(test_data *, struct iovec* vecs, int n_vecs);
+  /* Optional batched versions of the four above, for -B.
+     get_write_batch reserves room for as many of the nr messages as
+     it can, at least one, given their sizes, and says how many;
+     release_write_batch then publishes them together.  get_read_batch
+     waits for at least one message and hands back up to nr of them,
+     or 0 at the end of the test, and release_read_batch gives them all
+     back at once. */
+  int (*get_write_batch)(test_data *, struct batch_msg *msgs, int nr);
+  void (*release_write_batch)(test_data *, struct batch_msg *msgs, int nr);
+  int (*get_read_batch)(test_data *, struct batch_msg *msgs, int nr);
+  void (*release_read_batch)(test_data *, struct batch_msg *msgs, int nr);
   void (*parent_ping)(test_data *);
   void (*child_ping)(test_data *);
 } test_t;
@@ -74,6 +157,14 @@ rdtsc(void)
 
 void run_test(int argc, char *argv[], test_t *test);
 
+void *establish_test_segment(test_data *td, int nr_pages);
+
+/* For a parent which waits in shared memory for the child to say
+   it's finished: whether the child's gone, as it will have without
+   saying so if it failed a check.  Always 0 in thread mode, where a
+   child which fails takes the whole process with it. */
+int child_exited(test_data *td);
+
 void dump_tsc_counters(test_data *td, unsigned long *counts, int nr_samples);
 
 void logmsg(test_data *td,
@@ -70,6 +70,7 @@ get_read_buf(test_data *td, int len, int* n_vecs)
 {
   test_state *ps = (test_state *)td->data;
   xread(ps->sv[1], ps->buffer.iov_base, len);
+  ps->buffer.iov_len = len;
   *n_vecs = 1;
   return &ps->buffer;
 }
@@ -90,7 +91,7 @@ static void child_fin(test_data *td) {
 
 static struct iovec* get_write_buf(test_data *td, int len, int* n_vecs) {
   test_state *ps = (test_state *)td->data;
-  assert(len == td->size);
+  ps->buffer.iov_len = len;
   *n_vecs = 1;
   return &ps->buffer;
 }
@@ -114,6 +115,8 @@ main(int argc, char *argv[])
   test_t t = { 
     .name = "unix_thr",
     .is_latency_test = 0,
+    .data_size = sizeof(test_state),
+    .variable_size = 1,
     .init_test = init_test,
     .init_parent = init_local,
     .finish_parent = parent_fin,
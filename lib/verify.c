@@ -0,0 +1,334 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "verify.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* Reflected CRC-32C (Castagnoli) polynomial */
+#define POLY 0x82f63b78
+
+/* The software version goes a byte at a time.  The hardware version
+   runs three crc32 instructions side by side over three blocks of a
+   message, since each one takes three cycles but we can start one a
+   cycle, and then glues the three CRCs together with the shift tables:
+   shifting a CRC by n bytes of zeros is linear, so it's four table
+   lookups. */
+#define LONG 512
+#define SHORT 128
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static int have_sse42;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+
+  for (; vec; vec >>= 1, mat++)
+    if (vec & 1)
+      sum ^= *mat;
+  return sum;
+}
+
+static void
+gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+  int n;
+
+  for (n = 0; n < 32; n++)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* The operator which appends len (a power of two) zero bytes to a
+   CRC */
+static void
+crc32c_zeros_op(uint32_t *even, size_t len)
+{
+  uint32_t odd[32];
+  uint32_t row = 1;
+  int n;
+
+  /* One zero bit */
+  odd[0] = POLY;
+  for (n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  /* Two, then four */
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+  /* Then one byte, two bytes, and so on */
+  for (;;) {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (!len)
+      return;
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+    if (!len)
+      break;
+  }
+  memcpy(even, odd, sizeof(odd));
+}
+
+static void
+crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+  uint32_t op[32];
+  uint32_t n;
+
+  crc32c_zeros_op(op, len);
+  for (n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+static uint32_t
+crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+    zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void
+crc32c_init(void)
+{
+  uint32_t n, crc;
+  int k;
+
+  for (n = 0; n < 256; n++) {
+    crc = n;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    crc32c_table[n] = crc;
+  }
+  crc32c_zeros(crc32c_long, LONG);
+  crc32c_zeros(crc32c_short, SHORT);
+#if defined(__x86_64__)
+  have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("sse4.2"))) uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t crc0 = crc, crc1, crc2;
+  const unsigned char *end;
+  uint64_t w;
+
+  while (len && ((uintptr_t)p & 7)) {
+    crc0 = _mm_crc32_u8(crc0, *p++);
+    len--;
+  }
+#define THREE_WAY(block, zeros)						\
+  while (len >= 3 * (block)) {						\
+    crc1 = crc2 = 0;							\
+    for (end = p + (block); p < end; p += 8) {				\
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);			\
+      crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(p + (block)));	\
+      crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(p + 2 * (block))); \
+    }									\
+    crc0 = crc32c_shift(zeros, crc0) ^ crc1;				\
+    crc0 = crc32c_shift(zeros, crc0) ^ crc2;				\
+    p += 2 * (block);							\
+    len -= 3 * (block);							\
+  }
+  THREE_WAY(LONG, crc32c_long);
+  THREE_WAY(SHORT, crc32c_short);
+#undef THREE_WAY
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    crc0 = _mm_crc32_u64(crc0, w);
+  }
+  while (len--)
+    crc0 = _mm_crc32_u8(crc0, *p++);
+  return crc0;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (have_sse42)
+    return ~crc32c_hw(crc, buf, len);
+#endif
+  return ~crc32c_sw(crc, buf, len);
+}
+
+/* Copy len bytes at offset off of the message to or from buf */
+static void
+scatter_gather(const struct iovec *vecs, int n_vecs, size_t off, void *buf,
+	       size_t len, int to_message)
+{
+  char *b = buf;
+  int i;
+
+  for (i = 0; i < n_vecs && len; i++) {
+    size_t n;
+    if (off >= vecs[i].iov_len) {
+      off -= vecs[i].iov_len;
+      continue;
+    }
+    n = vecs[i].iov_len - off;
+    if (n > len)
+      n = len;
+    if (to_message)
+      memcpy((char *)vecs[i].iov_base + off, b, n);
+    else
+      memcpy(b, (char *)vecs[i].iov_base + off, n);
+    b += n;
+    len -= n;
+    off = 0;
+  }
+}
+
+static uint32_t
+message_crc(const struct iovec *vecs, int n_vecs, const struct msg_stamp *st)
+{
+  size_t skip = sizeof(*st);
+  uint32_t crc = 0;
+  int i;
+
+  for (i = 0; i < n_vecs; i++) {
+    if (skip >= vecs[i].iov_len) {
+      skip -= vecs[i].iov_len;
+      continue;
+    }
+    crc = crc32c(crc, (char *)vecs[i].iov_base + skip, vecs[i].iov_len - skip);
+    skip = 0;
+  }
+  crc = crc32c(crc, &st->seq, sizeof(st->seq));
+  return crc32c(crc, &st->len, sizeof(st->len));
+}
+
+static size_t
+message_len(const struct iovec *vecs, int n_vecs)
+{
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < n_vecs; i++)
+    len += vecs[i].iov_len;
+  return len;
+}
+
+void
+stamp_message(const struct iovec *vecs, int n_vecs, uint64_t seq)
+{
+  struct msg_stamp st;
+
+  st.seq = seq;
+  st.len = message_len(vecs, n_vecs);
+  st.crc = message_crc(vecs, n_vecs, &st);
+  scatter_gather(vecs, n_vecs, 0, &st, sizeof(st), 1);
+}
+
+int
+check_message(const struct iovec *vecs, int n_vecs, uint64_t seq,
+	      struct msg_stamp *found)
+{
+  scatter_gather(vecs, n_vecs, 0, found, sizeof(*found), 0);
+  if (found->seq != seq)
+    return STAMP_BAD_SEQ;
+  if (found->len != message_len(vecs, n_vecs))
+    return STAMP_BAD_LEN;
+  if (found->crc != message_crc(vecs, n_vecs, found))
+    return STAMP_BAD_CRC;
+  return STAMP_OK;
+}
+
+void
+check_start(struct stamp_check *sc)
+{
+  memset(sc, 0, sizeof(*sc));
+}
+
+void
+check_more(struct stamp_check *sc, const struct iovec *vecs, int n_vecs)
+{
+  size_t len = message_len(vecs, n_vecs);
+  size_t skip = 0;
+  int i;
+
+  /* The first few bytes are the stamp itself, which might be split
+     over fragments like anything else */
+  if (sc->len < sizeof(sc->found)) {
+    skip = sizeof(sc->found) - sc->len;
+    if (skip > len)
+      skip = len;
+    scatter_gather(vecs, n_vecs, 0, (char *)&sc->found + sc->len, skip, 0);
+  }
+  for (i = 0; i < n_vecs; i++) {
+    if (skip >= vecs[i].iov_len) {
+      skip -= vecs[i].iov_len;
+      continue;
+    }
+    sc->crc = crc32c(sc->crc, (char *)vecs[i].iov_base + skip,
+		     vecs[i].iov_len - skip);
+    skip = 0;
+  }
+  sc->len += len;
+}
+
+int
+check_finish(struct stamp_check *sc, uint64_t seq, struct msg_stamp *found)
+{
+  uint32_t crc;
+
+  *found = sc->found;
+  if (sc->len < sizeof(*found) || found->seq != seq)
+    return STAMP_BAD_SEQ;
+  if (found->len != sc->len)
+    return STAMP_BAD_LEN;
+  crc = crc32c(sc->crc, &found->seq, sizeof(found->seq));
+  crc = crc32c(crc, &found->len, sizeof(found->len));
+  if (found->crc != crc)
+    return STAMP_BAD_CRC;
+  return STAMP_OK;
+}
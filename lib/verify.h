@@ -0,0 +1,61 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* -V puts one of these at the front of every message.  The checksum
+   covers the rest of the message and then the other header fields,
+   so between them the receiver can spot corruption, loss, reordering
+   and duplication, whatever the payload looks like. */
+struct msg_stamp {
+  uint64_t seq;
+  uint32_t crc; /* CRC32C */
+  uint32_t len;
+};
+
+#define STAMP_OK 0
+#define STAMP_BAD_SEQ 1
+#define STAMP_BAD_LEN 2
+#define STAMP_BAD_CRC 3
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* The message is scattered over vecs, as a transport hands it to us */
+void stamp_message(const struct iovec *vecs, int n_vecs, uint64_t seq);
+int check_message(const struct iovec *vecs, int n_vecs, uint64_t seq,
+		  struct msg_stamp *found);
+
+/* The same check, for a message which arrives a fragment at a time
+   and which we never see all of at once. */
+struct stamp_check {
+  struct msg_stamp found;
+  size_t len; /* So far */
+  uint32_t crc;
+};
+
+void check_start(struct stamp_check *sc);
+void check_more(struct stamp_check *sc, const struct iovec *vecs, int n_vecs);
+int check_finish(struct stamp_check *sc, uint64_t seq, struct msg_stamp *found);
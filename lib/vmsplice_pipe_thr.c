@@ -66,7 +66,22 @@ const char* test_name = "vmsplice_coop_pipe_thr";
 #endif
 #endif
 
-int coop_reporting_chunk_size;
+int coop_reporting_chunk_size = 1024*1024;
+
+// 2MB == my L2 cache size / 2
+static int alloc_pages = 512;
+
+static tunable tunables[] = {
+#ifdef USE_HUGE_PAGES
+  { "VMSPLICE_ALLOC_PAGES", &alloc_pages, 512, 16384, 1 },
+#else
+  { "VMSPLICE_ALLOC_PAGES", &alloc_pages, 16, 16384, 1 },
+#endif
+#ifdef VMSPLICE_COOP
+  { "VMSPLICE_COOP_CHUNK", &coop_reporting_chunk_size, 4096, 64*1024*1024, 1 },
+#endif
+  { NULL }
+};
 
 typedef struct {
   int fds[2];
@@ -81,7 +96,7 @@ typedef struct {
   unsigned long ring_size;
   unsigned long total_read;
   void* read_buf;
-  struct iovec iov;
+  struct iovec iov[2]; /* Two when a message wraps around the ring */
 } pipe_state;
 
 static void
@@ -103,25 +118,26 @@ init_child(test_data *td)
   pipe_state *ps = (pipe_state *)td->data;
   ps->total_read = 0;
   ps->read_buf = xmalloc(td->size);
-  ps->iov.iov_base = ps->read_buf;
-  ps->iov.iov_len = td->size;
+  ps->iov[0].iov_base = ps->read_buf;
+  ps->iov[0].iov_len = td->size;
 }
 
 static struct iovec* get_read_buffer(test_data* td, int len, int* n_vecs) {
 
   pipe_state *ps = (pipe_state *)td->data;
-  xread(ps->fds[0], ps->read_buf, td->size);
+  xread(ps->fds[0], ps->read_buf, len);
+  ps->iov[0].iov_len = len;
   *n_vecs = 1;
-  return &ps->iov;
+  return ps->iov;
 
 }
 
 static void release_read_buffer(test_data* td, struct iovec* vecs, int n_vecs) {
 
   pipe_state *ps = (pipe_state *)td->data;
-  assert(vecs == &ps->iov && n_vecs == 1);
+  assert(vecs == ps->iov && n_vecs == 1);
 
-  ps->total_read += td->size;
+  ps->total_read += vecs[0].iov_len;
 #ifdef VMSPLICE_COOP
   while(ps->total_read >= coop_reporting_chunk_size) {
     xwrite(ps->ret_fds[1], &coop_reporting_chunk_size, sizeof(int));
@@ -136,9 +152,6 @@ static void child_finish(test_data* td) {
   xwrite(ps->fin_fds[1], "X", 1);
 }
 
-#define ALLOC_PAGES 512
-// 2MB == my L2 cache size / 2
-
 static void
 init_parent(test_data *td)
 {
@@ -151,7 +164,24 @@ init_parent(test_data *td)
   ps->bytes_written = 0;
   ps->chunks_written = 0;
   ps->chunks_read = 0;
-  ps->ring_size = ALLOC_PAGES * 4096;
+  ps->ring_size = alloc_pages * 4096;
+#ifdef VMSPLICE_COOP
+  if (coop_reporting_chunk_size >= ps->ring_size)
+    errx(1, "VMSPLICE_COOP_CHUNK must be smaller than the ring (%lu bytes)", ps->ring_size);
+#endif
+}
+
+/* Bigger messages are split up by the harness.  In coop mode the
+   reader only owns up to whole chunks, so we might be waiting on up to
+   a chunk's worth which it has already read. */
+static int
+max_fragment(test_data *td)
+{
+#ifdef VMSPLICE_COOP
+  return alloc_pages * 4096 - coop_reporting_chunk_size;
+#else
+  return alloc_pages * 4096;
+#endif
 }
 
 static struct iovec*
@@ -160,7 +190,7 @@ get_write_buffer(test_data *td, int len, int* n_vecs) {
   pipe_state *ps = (pipe_state *)td->data;
   int map_condition = !ps->mapped;
 #ifndef VMSPLICE_COOP
-  map_condition = map_condition || ((ps->write_offset + td->size) > (ps->ring_size));
+  map_condition = map_condition || ((ps->write_offset + len) > (ps->ring_size));
 #endif
   if(map_condition) {
     if(ps->mapped)
@@ -184,7 +214,8 @@ get_write_buffer(test_data *td, int len, int* n_vecs) {
   // write into the reporting pipe, which is also full - we wait for each other for want of a poll() call (but boo, more syscalls in the fast path).
   // This can't happen so long as the writer would *need* to reclaim tokens before possibly writing enough to cause the reader to fill the token buffer.
   // That is, the kernel pipe buffer size is large enough to contain sizeof(int) * (ring_size / reporting_chunk_size).
-  while((ps->ring_size - ((ps->chunks_written - ps->chunks_read) * coop_reporting_chunk_size)) < td->size) {
+  // The bytes we've written since the last whole chunk are in use too.
+  while((ps->ring_size - ((ps->chunks_written - ps->chunks_read) * coop_reporting_chunk_size) - ps->bytes_written) < len) {
     int rep_bytes = read(ps->ret_fds[0], ps->coop_buf, 4096);
     assert(rep_bytes % 4 == 0);
     int i;
@@ -195,35 +226,55 @@ get_write_buffer(test_data *td, int len, int* n_vecs) {
       ps->chunks_read++;
     }
   }
+  // A message which runs off the end of the ring carries on at the start,
+  // since the reader's reports only account for the bytes it's read.
+  if(ps->write_offset + len > ps->ring_size) {
+    ps->iov[0].iov_base = ps->mapped + ps->write_offset;
+    ps->iov[0].iov_len = ps->ring_size - ps->write_offset;
+    ps->iov[1].iov_base = ps->mapped;
+    ps->iov[1].iov_len = len - ps->iov[0].iov_len;
+    *n_vecs = 2;
+    return ps->iov;
+  }
 #endif
-  ps->iov.iov_base = ps->mapped + ps->write_offset;
-  ps->iov.iov_len = td->size;
+  ps->iov[0].iov_base = ps->mapped + ps->write_offset;
+  ps->iov[0].iov_len = len;
 
   *n_vecs = 1;
-  return &ps->iov;
+  return ps->iov;
 }
 
 static void release_write_buffer(test_data* td, struct iovec* vecs, int n_vecs) {
 
   pipe_state *ps = (pipe_state *)td->data;
-  assert(n_vecs == 1);
-  assert(vecs == &td->iov);
+  size_t len = 0;
+  int i;
+  assert(vecs == ps->iov && n_vecs <= 2);
+  for(i = 0; i < n_vecs; i++)
+    len += vecs[i].iov_len;
 #ifdef VMSPLICE_COOP
-  ps->bytes_written += td->size;
+  ps->bytes_written += len;
   while(ps->bytes_written >= coop_reporting_chunk_size) {
     ps->chunks_written++;
     ps->bytes_written -= coop_reporting_chunk_size;
   }
 #endif
-  ps->write_offset += td->size;
-  while(vecs[0].iov_len > 0) {
+  ps->write_offset += len;
+  while(n_vecs > 0) {
     ssize_t this_write = vmsplice(ps->fds[1], vecs, n_vecs, 0);
     if(this_write < 0)
       err(1, "vmsplice");
     else if(this_write == 0)
       break;
-    vecs[0].iov_len -= this_write;
-    vecs[0].iov_base = ((char*)vecs[0].iov_base) + this_write;
+    while(n_vecs > 0 && this_write >= vecs[0].iov_len) {
+      this_write -= vecs[0].iov_len;
+      vecs++;
+      n_vecs--;
+    }
+    if(n_vecs > 0) {
+      vecs[0].iov_len -= this_write;
+      vecs[0].iov_base = ((char*)vecs[0].iov_base) + this_write;
+    }
   }
 
 }
@@ -239,24 +290,13 @@ static void parent_finish(test_data* td) {
 int
 main(int argc, char *argv[])
 {
-#ifdef VMSPLICE_COOP
-  char* chunk_str = getenv("VMSPLICE_COOP_CHUNK");
-  if(chunk_str) {
-    char* str_end;
-    coop_reporting_chunk_size = strtol(chunk_str, &str_end, 10);
-    if(str_end[0]) {
-      err(1, "VMSPLICE_COOP_CHUNK must be an integer");
-    }
-  }
-  else {
-    coop_reporting_chunk_size = 1024*1024;
-  }
-  printf("Cooperative reporting: chunk size %dK\n", coop_reporting_chunk_size/1024);
-#endif
-
   test_t t = { 
     .name = test_name,
     .is_latency_test = 0,
+    .data_size = sizeof(pipe_state),
+    .variable_size = 1,
+    .max_fragment = max_fragment,
+    .tunables = tunables,
     .init_test = init_test,
     .init_parent = init_parent,
     .finish_parent = parent_finish,
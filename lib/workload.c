@@ -0,0 +1,238 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "workload.h"
+#include "xutil.h"
+
+enum {
+  DIST_FIXED,
+  DIST_UNIFORM,
+  DIST_BIMODAL,
+  DIST_LOGNORMAL,
+  DIST_ZIPF,
+  DIST_TRACE,
+};
+
+#define ZIPF_MAX (1 << 24)
+
+/* splitmix64: small, quick, and good enough for picking sizes */
+static uint64_t
+next_random(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* In [0, 1) */
+static double
+random_double(uint64_t *state)
+{
+  return (next_random(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+static void
+load_trace(struct distribution *d, const char *opt, const char *file)
+{
+  struct stat st;
+  size_t i;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    err(1, "%s: opening trace %s", opt, file);
+  if (fstat(fd, &st) < 0)
+    err(1, "%s: stat %s", opt, file);
+  if (st.st_size == 0 || st.st_size % sizeof(struct trace_record))
+    errx(1, "%s: %s isn't a whole number of %zd byte records", opt, file,
+	 sizeof(struct trace_record));
+  d->nr_records = st.st_size / sizeof(struct trace_record);
+  d->trace = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (d->trace == MAP_FAILED)
+    err(1, "%s: mapping %s", opt, file);
+  close(fd);
+  madvise((void *)d->trace, st.st_size, MADV_SEQUENTIAL);
+
+  /* One pass to find out how big the buffers need to be */
+  d->min = d->max = d->trace[0].size;
+  for (i = 1; i < d->nr_records; i++) {
+    if (d->trace[i].size < d->min)
+      d->min = d->trace[i].size;
+    if (d->trace[i].size > d->max)
+      d->max = d->trace[i].size;
+  }
+}
+
+struct distribution *
+parse_distribution(const char *opt, const char *spec)
+{
+  struct distribution *d = xmalloc(sizeof(*d));
+  char kind[16];
+  int n;
+
+  memset(d, 0, sizeof(*d));
+  d->spec = spec;
+  if (sscanf(spec, "%15[a-z]:%n", kind, &n) != 1 || !n)
+    errx(1, "%s: %s isn't <distribution>:<parameters>", opt, spec);
+  spec += n;
+
+  if (!strcmp(kind, "fixed")) {
+    d->kind = DIST_FIXED;
+    if (sscanf(spec, "%ld", &d->a) != 1 || d->a < 0)
+      errx(1, "%s wants fixed:<n>", opt);
+    d->min = d->max = d->a;
+  } else if (!strcmp(kind, "uniform")) {
+    d->kind = DIST_UNIFORM;
+    if (sscanf(spec, "%ld:%ld", &d->a, &d->b) != 2 || d->a < 0 || d->b < d->a)
+      errx(1, "%s wants uniform:<min>:<max>", opt);
+    d->min = d->a;
+    d->max = d->b;
+  } else if (!strcmp(kind, "bimodal")) {
+    d->kind = DIST_BIMODAL;
+    if (sscanf(spec, "%ld:%ld:%lf", &d->a, &d->b, &d->p) != 3 ||
+	d->a < 0 || d->b < 0 || d->p < 0 || d->p > 1)
+      errx(1, "%s wants bimodal:<small>:<large>:<fraction large>", opt);
+    d->min = d->a < d->b ? d->a : d->b;
+    d->max = d->a < d->b ? d->b : d->a;
+  } else if (!strcmp(kind, "lognormal")) {
+    d->kind = DIST_LOGNORMAL;
+    if (sscanf(spec, "%ld:%lf:%ld", &d->a, &d->p, &d->b) != 3 ||
+	d->a <= 0 || d->p < 0 || d->b < 1)
+      errx(1, "%s wants lognormal:<median>:<sigma>:<max>", opt);
+    d->min = 0;
+    d->max = d->b;
+  } else if (!strcmp(kind, "zipf")) {
+    double total = 0;
+    long i;
+    d->kind = DIST_ZIPF;
+    if (sscanf(spec, "%ld:%lf", &d->a, &d->p) != 2 || d->a < 1 || d->a > ZIPF_MAX)
+      errx(1, "%s wants zipf:<max>:<exponent>, with max up to %d", opt, ZIPF_MAX);
+    d->cdf = xmalloc(d->a * sizeof(double));
+    for (i = 0; i < d->a; i++) {
+      total += pow(i + 1, -d->p);
+      d->cdf[i] = total;
+    }
+    for (i = 0; i < d->a; i++)
+      d->cdf[i] /= total;
+    d->min = 1;
+    d->max = d->a;
+  } else if (!strcmp(kind, "trace")) {
+    d->kind = DIST_TRACE;
+    load_trace(d, opt, spec);
+  } else {
+    errx(1, "%s: no distribution called %s", opt, kind);
+  }
+  return d;
+}
+
+static long
+sample(const struct distribution *d, uint64_t *rng)
+{
+  long lo, hi;
+  double u, v;
+
+  switch (d->kind) {
+  case DIST_FIXED:
+    return d->a;
+  case DIST_UNIFORM:
+    return d->a + next_random(rng) % (d->b - d->a + 1);
+  case DIST_BIMODAL:
+    return random_double(rng) < d->p ? d->b : d->a;
+  case DIST_LOGNORMAL:
+    /* Box-Muller */
+    u = 1 - random_double(rng);
+    v = random_double(rng);
+    u = d->a * exp(d->p * sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+    return u > d->b ? d->b : (long)u;
+  case DIST_ZIPF:
+    u = random_double(rng);
+    lo = 0;
+    hi = d->a - 1;
+    while (lo < hi) {
+      long mid = (lo + hi) / 2;
+      if (d->cdf[mid] < u)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    return lo + 1;
+  }
+  abort();
+}
+
+void
+workload_start(struct workload_cursor *c, int seed)
+{
+  c->size_rng = 0x5eed0000u + seed;
+  c->gap_rng = 0x9a900000u + seed;
+  c->size_n = 0;
+  c->gap_n = 0;
+}
+
+int
+workload_size(const struct workload *wl, struct workload_cursor *c,
+	      int fixed, int floor)
+{
+  const struct distribution *d = wl ? wl->sizes : NULL;
+  long size;
+
+  if (!d)
+    return fixed;
+  if (d->kind == DIST_TRACE)
+    size = d->trace[c->size_n++ % d->nr_records].size;
+  else
+    size = sample(d, &c->size_rng);
+  return size < floor ? floor : size;
+}
+
+long
+workload_gap(const struct workload *wl, struct workload_cursor *c)
+{
+  const struct distribution *d = wl ? wl->gaps : NULL;
+  const struct trace_record *this, *prev;
+  uint64_t n;
+
+  if (!d)
+    return 0;
+  if (d->kind != DIST_TRACE)
+    return sample(d, &c->gap_rng);
+  n = c->gap_n++ % d->nr_records;
+  if (n == 0)
+    return 0;
+  this = &d->trace[n];
+  prev = &d->trace[n - 1];
+  return this->time_ns > prev->time_ns ? this->time_ns - prev->time_ns : 0;
+}
@@ -0,0 +1,78 @@
+/*
+    Copyright (c) 2011 Anil Madhavapeddy <anil@recoil.org>
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use,
+    copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the sizes of messages (-d) and the gaps between them (-g)
+   come from.  A spec is one of
+
+     fixed:<n>
+     uniform:<min>:<max>
+     bimodal:<small>:<large>:<fraction which are large>
+     lognormal:<median>:<sigma>:<max>
+     zipf:<max>:<exponent>       (n has probability proportional to n^-exponent)
+     trace:<file>
+
+   Sizes are in bytes and gaps in nanoseconds.  A trace is a file of
+   struct trace_records, which we map rather than read in, so it can be
+   as big as you like; -d takes the sizes from it and -g the gaps
+   between the timestamps. */
+struct trace_record {
+  uint64_t time_ns;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+struct distribution {
+  const char *spec;
+  int kind;
+  long a, b;
+  double p;
+  double *cdf; /* zipf */
+  const struct trace_record *trace;
+  size_t nr_records;
+  long min, max;
+};
+
+struct workload {
+  struct distribution *sizes; /* NULL for every message being -s */
+  struct distribution *gaps; /* NULL to send as fast as we can */
+};
+
+/* Each end has one of these.  They start from the same seed, so the
+   consumer sees the same sequence of sizes as the producer did, and
+   stream transports know how much to read. */
+struct workload_cursor {
+  uint64_t size_rng, gap_rng;
+  uint64_t size_n, gap_n; /* Where we are in a trace */
+};
+
+struct distribution *parse_distribution(const char *opt, const char *spec);
+void workload_start(struct workload_cursor *c, int seed);
+/* Never less than floor, which is how small the harness can cope with */
+int workload_size(const struct workload *wl, struct workload_cursor *c,
+		  int fixed, int floor);
+long workload_gap(const struct workload *wl, struct workload_cursor *c);
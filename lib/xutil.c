@@ -38,6 +38,7 @@
 #include <err.h>
 #include <inttypes.h>
 #include "atomicio.h"
+#include "kernels.h"
 #include "xutil.h"
 #include "test.h"
 
@@ -69,9 +70,10 @@ xwrite(int fd, const void *buf, size_t count)
     err(1, "xwrite");
 }
 
-static double
+double
 get_tsc_freq(void)
 {
+  static double freq;
   double estimates[5];
   int nr_estimates;
   struct timeval start;
@@ -82,6 +84,9 @@ get_tsc_freq(void)
   double total;
   int i;
 
+  if (freq)
+    return freq;
+
   while (1) {
     for (nr_estimates = 0; nr_estimates < 5; nr_estimates++) {
       gettimeofday(&start, NULL);
@@ -120,7 +125,8 @@ get_tsc_freq(void)
   total = 0;
   for (i = 0; i < nr_estimates; i++)
     total += estimates[i];
-  return total / nr_estimates;
+  freq = total / nr_estimates;
+  return freq;
 }
 
 static FILE *
@@ -172,7 +178,7 @@ dump_tsc_counters(test_data *td, unsigned long *counts, int nr_samples)
 static void
 help(char *argv[])
 {
-  fprintf(stderr, "Usage:\n%s [-h] [-a <cpuid>] [-b <cpuid>] [-p <num] [-t] [-s <bytes>] [-c <num>] [-o <directory>] [-n <node>]\n", argv[0]);
+  fprintf(stderr, "Usage:\n%s [-h] [-a <cpuid>] [-b <cpuid>] [-p <num] [-t] [-T] [-s <bytes>] [-c <num>] [-o <directory>] [-n <node>] [-x <sweep file>] [-u] [-k <kernel>] [-N <mode>[:<bytes>]] [-C <cache>] [-D <cache>] [-d <sizes>] [-g <gaps>] [-B <num>] [-W <strategy>] [-v|-V]\n", argv[0]);
   fprintf(stderr, "-h: show this help message\n");
   fprintf(stderr, "-a: CPU id that the first process should have affinity with\n");
   fprintf(stderr, "-b: CPU id that the second process should have affinity with\n");
@@ -182,13 +188,31 @@ help(char *argv[])
   fprintf(stderr, "-c: Number of iterations\n");
   fprintf(stderr, "-o: Where to put the various output files\n");
   fprintf(stderr, "-n: NUMA node for shared arena, if any\n");
+  fprintf(stderr, "-T: run the two ends as threads of one process rather than forking\n");
+  fprintf(stderr, "-x: run every point of the sweep described in this file\n");
+  fprintf(stderr, "-u: search the transport's tunables for the best configuration\n");
+  fprintf(stderr, "-k: kernel to fill, copy and check payloads with (default glibc; auto picks the fastest the CPU has); one of");
+  list_kernels(stderr);
+  fprintf(stderr, "-N: copy messages of at least <bytes> with non-temporal stores, loads or both\n");
+  fprintf(stderr, "-C: where the producer's source is: hot (default), cold (flushed before each send) or pool:<bytes>\n");
+  fprintf(stderr, "-D: the same for the consumer's destination\n");
+  fprintf(stderr, "-d: draw message sizes from fixed:<n>, uniform:<min>:<max>, bimodal:<small>:<large>:<fraction>,\n"
+	  "    lognormal:<median>:<sigma>:<max>, zipf:<max>:<exponent> or trace:<file> (overrides -s)\n");
+  fprintf(stderr, "-g: draw the nanoseconds between sends from the same, rather than sending back to back;\n"
+	  "    latency tests sleep for them between pings and log the latency after each\n");
+  fprintf(stderr, "-B: move up to this many messages per call, if the transport can\n");
+  fprintf(stderr, "-W: how to wait on shared memory: spin, pause, yield, futex[:<spins>], umwait or adaptive\n");
+  fprintf(stderr, "-v: check that message i is full of the byte i\n");
+  fprintf(stderr, "-V: stamp messages with a sequence number and CRC32C, and check them\n");
   exit(1);
 }
 
 void
 parse_args(int argc, char *argv[], bool *per_iter_timings, int *size, size_t *count, int *first_cpu, int *second_cpu,
 	   int *parallel, char **output_dir, int *write_in_place, int *read_in_place, int *produce_method, int *do_verify,
-	   int *numa_node)
+	   int *numa_node, int *threaded, char **sweep_file, int *tune, char **kernel,
+	   char **nt, char **source_cache, char **dest_cache, char **sizes, char **gaps, int *batch,
+	   char **wait)
 {
   int opt;
   *per_iter_timings = false;
@@ -203,7 +227,18 @@ parse_args(int argc, char *argv[], bool *per_iter_timings, int *size, size_t *co
   *read_in_place = 0;
   *write_in_place = 0;
   *do_verify = 0;
-  while((opt = getopt(argc, argv, "h?tp:a:b:s:c:o:wrvm:n:")) != -1) {
+  *threaded = 0;
+  *sweep_file = NULL;
+  *tune = 0;
+  *kernel = "glibc";
+  *nt = NULL;
+  *source_cache = NULL;
+  *dest_cache = NULL;
+  *sizes = NULL;
+  *gaps = NULL;
+  *batch = 1;
+  *wait = NULL;
+  while((opt = getopt(argc, argv, "h?tTp:a:b:s:c:o:wrvVm:n:x:uk:N:C:D:d:g:B:W:")) != -1) {
     switch(opt) {
      case 't':
       *per_iter_timings = true;
@@ -238,9 +273,45 @@ parse_args(int argc, char *argv[], bool *per_iter_timings, int *size, size_t *co
     case 'v':
       *do_verify = 1;
       break;
+    case 'V':
+      *do_verify = 2;
+      break;
     case 'n':
       *numa_node = atoi(optarg);
       break;
+    case 'T':
+      *threaded = 1;
+      break;
+    case 'x':
+      *sweep_file = optarg;
+      break;
+    case 'u':
+      *tune = 1;
+      break;
+    case 'k':
+      *kernel = optarg;
+      break;
+    case 'N':
+      *nt = optarg;
+      break;
+    case 'C':
+      *source_cache = optarg;
+      break;
+    case 'D':
+      *dest_cache = optarg;
+      break;
+    case 'd':
+      *sizes = optarg;
+      break;
+    case 'g':
+      *gaps = optarg;
+      break;
+    case 'B':
+      *batch = atoi(optarg);
+      break;
+    case 'W':
+      *wait = optarg;
+      break;
      case '?':
      case 'h':
       help(argv);
@@ -250,9 +321,12 @@ parse_args(int argc, char *argv[], bool *per_iter_timings, int *size, size_t *co
     }
   }
 
-  fprintf(stderr, "size %d count %" PRIu64 " first_cpu %d second_cpu %d parallel %d tsc %d produce-method %d %s %s numa_node %d output_dir %s\n",
+  fprintf(stderr, "size %d count %" PRIu64 " first_cpu %d second_cpu %d parallel %d tsc %d produce-method %d %s %s numa_node %d %s kernel %s nt %s source %s dest %s sizes %s gaps %s batch %d wait %s output_dir %s\n",
 	  *size, *count, *first_cpu, *second_cpu, *parallel, *per_iter_timings, *produce_method, *read_in_place ? "read-in-place" : "copy-read", *write_in_place ? "write-in-place" : "copy-write",
-	  *numa_node,
+	  *numa_node, *threaded ? "threads" : "processes", *kernel, *nt ? *nt : "off",
+	  *source_cache ? *source_cache : "hot", *dest_cache ? *dest_cache : "hot",
+	  *sizes ? *sizes : "fixed", *gaps ? *gaps : "none", *batch,
+	  *wait ? *wait : "default",
 	  *output_dir);
 }
 
@@ -264,13 +338,13 @@ setaffinity(int cpunum)
   size_t size;
   int i;
   int nrcpus = 160;
-  pid_t pid;
   mask = CPU_ALLOC(nrcpus);
   size = CPU_ALLOC_SIZE(nrcpus);
   CPU_ZERO_S(size, mask);
   CPU_SET_S(cpunum, size, mask);
-  pid = getpid();
-  i = sched_setaffinity(pid, size, mask);
+  /* Pid 0 means the calling thread, which is what we want in thread
+     mode and is the whole process otherwise. */
+  i = sched_setaffinity(0, size, mask);
   if (i == -1)
     err(1, "sched_setaffinity");
   CPU_FREE(mask);
@@ -312,6 +386,34 @@ establish_shm_segment(int nr_pages, int numa_node)
 #endif
 }
 
+/* Plain anonymous memory, for when both ends live in one address
+   space and don't need a shared mapping. */
+void *
+establish_private_segment(int nr_pages, int numa_node)
+{
+  void *addr;
+
+  addr = mmap(NULL, PAGE_SIZE * nr_pages, PROT_READ|PROT_WRITE,
+	      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED)
+    err(1, "mapping private segment");
+
+#ifdef Linux
+  if(numa_node != -1)
+    numa_tonode_memory(addr, PAGE_SIZE * nr_pages, numa_node);
+#endif
+
+  return addr;
+}
+
+void *
+establish_test_segment(test_data *td, int nr_pages)
+{
+  if (td->threaded)
+    return establish_private_segment(nr_pages, td->numa_node);
+  return establish_shm_segment(nr_pages, td->numa_node);
+}
+
 void
 logmsg(test_data *td, const char *file, const char *fmt, ...)
 {
@@ -31,10 +31,14 @@ void xread(int, void *, size_t);
 void xwrite(int, const void *, size_t);
 
 void setaffinity(int);
+double get_tsc_freq(void);
 void parse_args(int argc, char *argv[], bool *per_iter_timings, int *size, size_t *count,
 		int *first_cpu, int *second_cpu, int *parallel, char **output_dir, int *wip, int *rip, int *prod, int *do_verify,
-		int *numa_node);
+		int *numa_node, int *threaded, char **sweep_file, int *tune, char **kernel,
+		char **nt, char **source_cache, char **dest_cache, char **sizes, char **gaps, int *batch,
+		char **wait);
 void *establish_shm_segment(int nr_pages, int numa_node);
+void *establish_private_segment(int nr_pages, int numa_node);
 
 /* Doesn't really belong here, but doesn't really belong anywhere. */
 void summarise_samples(FILE *f, double *data, int nr_samples);
@@ -42,3 +46,22 @@ void summarise_samples(FILE *f, double *data, int nr_samples);
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096
 #endif
+
+/* Start pulling [p, p + len) towards this core.  If we're going to
+   write to it then ask for it exclusive (prefetchw), which saves
+   another round trip to the other core when we do. */
+static inline void
+prefetch_range(const volatile void *p, size_t len, int for_write)
+{
+  const char *c = (const char *)((unsigned long)p & ~63ul);
+  const char *end = (const char *)p + len;
+
+  for (; c < end; c += 64) {
+#ifdef USE_INLINE_ASM
+    if (for_write)
+      asm volatile ("prefetchw %0" : : "m" (*c));
+    else
+#endif
+      __builtin_prefetch(c, 0, 3);
+  }
+}